@@ -0,0 +1,168 @@
+#include "Advance.hpp"
+
+#include "critical.hpp"
+
+using namespace HAL::BLDC;
+
+// one electrical revolution consists of 6 commutation steps
+static constexpr uint32_t eRPMDividend = 60000000UL / 6;
+// shortest delay the one shot timer is able to schedule
+static constexpr uint32_t MinDelay = 2;
+
+static Advance::Point curve[Advance::MaxPoints] = {
+	Advance::DefaultCurve[0],
+	Advance::DefaultCurve[1],
+	Advance::DefaultCurve[2],
+};
+static uint8_t points = Advance::DefaultPoints;
+// learned advance correction per curve point in degrees
+static int8_t trim[Advance::MaxPoints];
+
+// optimization window in current measurement blocks (125us each)
+static constexpr uint16_t SettleBlocks = 128;
+static constexpr uint16_t WindowBlocks = SettleBlocks + 512;
+static constexpr int8_t MaxTrim = 10;
+static constexpr int32_t NoCurrent = INT32_MAX;
+
+static bool optimize;
+static uint16_t block;
+static int32_t currentSum;
+static uint32_t windowInterval;
+static uint8_t windowPoint;
+static int32_t lastCurrent = NoCurrent;
+static int8_t direction = 1;
+
+static uint8_t Degrees(uint8_t point) {
+	int16_t deg = curve[point].degrees + trim[point];
+	if (deg < 0) {
+		deg = 0;
+	} else if (deg > Advance::MaxDegrees) {
+		deg = Advance::MaxDegrees;
+	}
+	return deg;
+}
+
+static uint8_t NearestPoint(uint32_t eRPM) {
+	uint8_t nearest = 0;
+	for (uint8_t i = 1; i < points; i++) {
+		if (eRPM >= (curve[i - 1].eRPM + curve[i].eRPM) / 2) {
+			nearest = i;
+		}
+	}
+	return nearest;
+}
+
+bool HAL::BLDC::Advance::CheckCurve(const Point* p, uint8_t count) {
+	if (!count || count > MaxPoints) {
+		return false;
+	}
+	for (uint8_t i = 0; i < count; i++) {
+		if (p[i].degrees > MaxDegrees
+				|| (i && p[i].eRPM <= p[i - 1].eRPM)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool HAL::BLDC::Advance::SetCurve(const Point* p, uint8_t count) {
+	if (!CheckCurve(p, count)) {
+		return false;
+	}
+	CriticalSection crit;
+	for (uint8_t i = 0; i < count; i++) {
+		curve[i] = p[i];
+		trim[i] = 0;
+	}
+	points = count;
+	block = 0;
+	lastCurrent = NoCurrent;
+	return true;
+}
+
+uint16_t HAL::BLDC::Advance::GetAdvance(uint32_t usPerStep) {
+	if (!usPerStep) {
+		return 0;
+	}
+	const uint32_t eRPM = eRPMDividend / usPerStep;
+	if (eRPM <= curve[0].eRPM) {
+		return Degrees(0) * 16;
+	}
+	for (uint8_t i = 1; i < points; i++) {
+		if (eRPM < curve[i].eRPM) {
+			const int32_t lower = Degrees(i - 1) * 16;
+			const int32_t upper = Degrees(i) * 16;
+			return lower
+					+ (upper - lower) * (int32_t) (eRPM - curve[i - 1].eRPM)
+							/ (int32_t) (curve[i].eRPM - curve[i - 1].eRPM);
+		}
+	}
+	return Degrees(points - 1) * 16;
+}
+
+uint32_t HAL::BLDC::Advance::CommutationDelay(uint32_t usPerStep,
+		int32_t timeSinceCrossing) {
+	// 60° per step, commutation is due 30° - advance after the crossing
+	const int32_t delay = (int32_t) (usPerStep
+			* (30 * 16 - GetAdvance(usPerStep)) / (60 * 16)) - timeSinceCrossing;
+	if (delay < (int32_t) MinDelay) {
+		// crossing was detected too late, commutate immediately
+		return MinDelay;
+	}
+	return delay;
+}
+
+void HAL::BLDC::Advance::EnableOptimization(bool enable) {
+	block = 0;
+	lastCurrent = NoCurrent;
+	optimize = enable;
+}
+
+bool HAL::BLDC::Advance::OptimizationEnabled() {
+	return optimize;
+}
+
+void HAL::BLDC::Advance::Optimize(uint32_t usPerStep, int32_t current) {
+	if (!optimize || !usPerStep) {
+		return;
+	}
+	const uint8_t point = NearestPoint(eRPMDividend / usPerStep);
+	if (block == 0) {
+		windowInterval = usPerStep;
+		windowPoint = point;
+		currentSum = 0;
+	}
+	// skip the transient after changing the advance
+	if (++block <= SettleBlocks) {
+		return;
+	}
+	currentSum += current;
+	if (block < WindowBlocks) {
+		return;
+	}
+	block = 0;
+
+	const uint32_t deviation =
+			usPerStep > windowInterval ?
+					usPerStep - windowInterval : windowInterval - usPerStep;
+	if (deviation > windowInterval / 32 || point != windowPoint) {
+		// speed not constant, start over
+		lastCurrent = NoCurrent;
+		return;
+	}
+	const int32_t mean = currentSum / (WindowBlocks - SettleBlocks);
+	if (lastCurrent != NoCurrent && mean > lastCurrent) {
+		// last step increased the current, reverse
+		direction = -direction;
+	}
+	lastCurrent = mean;
+
+	int8_t t = trim[point] + direction;
+	if (t > MaxTrim || t < -MaxTrim
+			|| curve[point].degrees + t > MaxDegrees
+			|| curve[point].degrees + t < 0) {
+		direction = -direction;
+		t = trim[point] + direction;
+	}
+	trim[point] = t;
+}
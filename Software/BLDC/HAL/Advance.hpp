@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+namespace HAL {
+namespace BLDC {
+namespace Advance {
+
+/* Point of the advance curve, advance in electrical degrees at eRPM */
+struct Point {
+	uint32_t eRPM;
+	uint8_t degrees;
+};
+
+static constexpr uint8_t MaxPoints = 8;
+static constexpr uint8_t MaxDegrees = 29;
+
+/* 0° at standstill to 20° at 40000 eRPM */
+static constexpr Point DefaultCurve[] = {
+	{ 0, 0 },
+	{ 10000, 10 },
+	{ 40000, 20 },
+};
+static constexpr uint8_t DefaultPoints = sizeof(DefaultCurve)
+		/ sizeof(DefaultCurve[0]);
+
+/*
+ * True for 1 to MaxPoints points with strictly increasing eRPM and at most
+ * MaxDegrees advance
+ */
+bool CheckCurve(const Point *points, uint8_t count);
+
+/*
+ * Sets the advance curve, linear interpolation between the points, constant
+ * below the first and above the last point. Resets the values learned by
+ * the optimization. Returns false and keeps the curve if CheckCurve() fails.
+ */
+bool SetCurve(const Point *points, uint8_t count);
+
+/* Interpolated advance in 1/16 electrical degree */
+uint16_t GetAdvance(uint32_t usPerStep);
+
+/*
+ * Time from now until the next commutation. The commutation is due 30° minus
+ * advance after the zero crossing, the detection latency is subtracted
+ * (negative for a crossing that is still ahead).
+ */
+uint32_t CommutationDelay(uint32_t usPerStep, int32_t timeSinceCrossing);
+
+/*
+ * Perturb and observe optimization: at constant speed the advance of the
+ * nearest curve point is varied in 1° steps towards lower mean current.
+ * Optimize() has to be called for every current measurement block.
+ */
+void EnableOptimization(bool enable);
+bool OptimizationEnabled();
+void Optimize(uint32_t usPerStep, int32_t current);
+
+}
+}
+}
@@ -12,6 +12,15 @@ public:
 	using ADCCallback = void (*)(void* ptr, uint32_t voltage, uint32_t current);
 
 	virtual void SetPWM(int16_t promille) = 0;
+	/* Duty cycle in Q15, DutyOne = 100% */
+	static constexpr uint16_t DutyOne = 32768;
+	virtual void SetDuty(uint16_t q15) = 0;
+
+	/* Converts a duty cycle in promille (Q16) to Q15, negative values to 0 */
+	static constexpr uint16_t DutyFromPromille(int32_t promilleQ16) {
+		return promilleQ16 > 0 ?
+				((int64_t) promilleQ16 * DutyOne / 1000) >> 16 : 0;
+	}
 
 	virtual void InitiateStart() = 0;
 
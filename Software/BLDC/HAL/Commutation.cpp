@@ -0,0 +1,54 @@
+#include "Commutation.hpp"
+
+#include "lowlevel.hpp"
+#include "Detector.hpp"
+
+using namespace HAL::BLDC;
+
+using LowLevel::State;
+using Detector::Phase;
+
+struct Step {
+	State a, b, c;
+	Phase floating;
+	bool rising;
+};
+
+static constexpr Step Steps[6] = {
+	{ State::High, State::Idle, State::Low, Phase::B, true },
+	{ State::Idle, State::High, State::Low, Phase::A, false },
+	{ State::Low, State::High, State::Idle, Phase::C, true },
+	{ State::Low, State::Idle, State::High, Phase::B, false },
+	{ State::Idle, State::Low, State::High, Phase::A, true },
+	{ State::High, State::Low, State::Idle, Phase::C, false },
+};
+
+// consecutive steps share one driven phase, the floating one is driven in the other
+static constexpr State Merge(State s, State next) {
+	return s == State::Idle ? next : s;
+}
+
+void HAL::BLDC::Commutation::SetStep(uint8_t step, bool reverse) {
+	const Step &s = Steps[step % 6];
+	LowLevel::SetPhase(LowLevel::Phase::A, s.a);
+	LowLevel::SetPhase(LowLevel::Phase::B, s.b);
+	LowLevel::SetPhase(LowLevel::Phase::C, s.c);
+	Detector::SetPhase(s.floating, s.rising != reverse);
+}
+
+void HAL::BLDC::Commutation::SetHalfStep(uint8_t step) {
+	const Step &s = Steps[step % 6];
+	const Step &n = Steps[(step + 1) % 6];
+	LowLevel::SetPhase(LowLevel::Phase::A, Merge(s.a, n.a));
+	LowLevel::SetPhase(LowLevel::Phase::B, Merge(s.b, n.b));
+	LowLevel::SetPhase(LowLevel::Phase::C, Merge(s.c, n.c));
+}
+
+void HAL::BLDC::Commutation::SetFineStep(uint8_t step) {
+	step %= 12;
+	if (step & 0x01) {
+		SetHalfStep(step / 2);
+	} else {
+		SetStep(step / 2);
+	}
+}
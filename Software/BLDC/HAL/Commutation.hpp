@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+namespace HAL {
+namespace BLDC {
+namespace Commutation {
+
+/*
+ * Energizes two phases of step 0-5 and senses the floating phase. Reverse
+ * rotation walks the steps backwards, its crossings have the opposite slope.
+ */
+void SetStep(uint8_t step, bool reverse = false);
+
+/*
+ * Energizes all three phases, the field points halfway between step and
+ * step + 1. Used at standstill only, the detector is not reconfigured.
+ */
+void SetHalfStep(uint8_t step);
+
+/* Step 0-11 in 30° increments, odd steps are half steps */
+void SetFineStep(uint8_t step);
+
+}
+}
+}
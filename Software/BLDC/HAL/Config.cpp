@@ -0,0 +1,219 @@
+#include "Config.hpp"
+
+#include <cstddef>
+
+#include "stm32f3xx_hal.h"
+#include "stm32f303x8.h"
+#include "critical.hpp"
+#include "Logging.hpp"
+
+using namespace HAL::BLDC;
+
+// reserved by the linker script, two flash pages
+extern "C" uint32_t _sconfig[];
+
+const Config::Parameters Config::Defaults = {
+	{
+		140000,		// start ramp length in us
+		800,		// final RPM
+		12,			// motor poles
+		10000,		// maximum commutation period in us
+		100,		// minPWM
+		101,		// finalPWM
+		StartRamp::Shape::ConstantAcceleration,
+	},
+	25,				// idleThreshold
+	3,				// blanking
+	112,			// samplingOffset
+	1000,			// maxPWM
+	15000,			// currentLimit, 1W shunt: 31A continuous
+	0,				// brakeCurrent, phases shorted
+	0,				// maxBusVoltage, supply voltage at the start of braking
+	10,				// torqueKp
+	10000,			// torqueKi
+	SpeedControl::DefaultParameters,
+	{
+		Advance::DefaultCurve[0],
+		Advance::DefaultCurve[1],
+		Advance::DefaultCurve[2],
+	},
+	Advance::DefaultPoints,
+	{ },			// no angle correction
+	{ },			// not identified
+};
+
+static Config::Parameters active = Config::Defaults;
+const Config::Parameters &Config::Active = active;
+
+namespace {
+
+struct Record {
+	uint32_t magic;
+	uint32_t sequence;
+	uint16_t version;
+	uint16_t length;
+	Config::Parameters parameters;
+	uint32_t crc;
+};
+
+}
+
+static constexpr uint32_t Magic = 0x43444C42;	// "BLDC"
+static constexpr uint32_t Erased = 0xFFFFFFFF;
+static constexpr uint8_t Pages = 2;
+static constexpr uint32_t SlotSize = (sizeof(Record) + 7) & ~7UL;
+static constexpr uint16_t SlotsPerPage = FLASH_PAGE_SIZE / SlotSize;
+static_assert(sizeof(Record) % 4 == 0, "Records are written in words");
+static_assert(SlotsPerPage >= 2, "Configuration record exceeds a flash page");
+
+// idle tracking hysteresis in Detector.cpp
+static constexpr uint16_t MinIdleThreshold = 16;
+static constexpr uint8_t MaxBlanking = 20;
+
+// sequence number of the newest record
+static uint32_t sequence;
+
+static const Record* Slot(uint8_t page, uint16_t slot) {
+	return (const Record*) ((uintptr_t) _sconfig + page * FLASH_PAGE_SIZE
+			+ slot * SlotSize);
+}
+
+static uint16_t UsedSlots(uint8_t page) {
+	uint16_t slot = 0;
+	while (slot < SlotsPerPage && Slot(page, slot)->magic != Erased) {
+		slot++;
+	}
+	return slot;
+}
+
+static uint32_t CRC32(const Record *r) {
+	// CRC unit with its reset configuration (CRC-32, word input)
+	CRC->CR = CRC_CR_RESET;
+	const uint32_t *data = (const uint32_t*) r;
+	for (uint16_t i = 0; i < offsetof(Record, crc) / 4; i++) {
+		CRC->DR = data[i];
+	}
+	return CRC->DR;
+}
+
+static bool Check(const Config::Parameters &p) {
+	return StartRamp::Generate(p.start, nullptr, nullptr)
+			&& p.start.finalPWM <= 1000 && !(p.start.motorPoles & 0x01)
+			&& p.idleThreshold >= MinIdleThreshold
+			&& p.blanking && p.blanking <= MaxBlanking
+			&& p.samplingOffset && p.samplingOffset < TIM1->ARR
+			&& p.maxPWM > 0 && p.maxPWM <= 1000
+			&& p.torqueKp >= 0 && p.torqueKi >= 0
+			&& p.speed.minDuty <= p.speed.maxDuty
+			&& Advance::CheckCurve(p.advance, p.advancePoints);
+}
+
+static bool Valid(const Record *r) {
+	return r->magic == Magic && r->version == Config::Version
+			&& r->length == sizeof(Config::Parameters) && r->crc == CRC32(r)
+			&& Check(r->parameters);
+}
+
+bool HAL::BLDC::Config::Load() {
+	__HAL_RCC_CRC_CLK_ENABLE();
+	// records are appended, the newest of a page is its last used slot
+	int16_t last[Pages];
+	for (uint8_t page = 0; page < Pages; page++) {
+		last[page] = UsedSlots(page) - 1;
+	}
+	while (last[0] >= 0 || last[1] >= 0) {
+		uint8_t page;
+		if (last[0] < 0) {
+			page = 1;
+		} else if (last[1] < 0) {
+			page = 0;
+		} else {
+			page = Slot(1, last[1])->sequence > Slot(0, last[0])->sequence;
+		}
+		const Record *r = Slot(page, last[page]);
+		if (r->sequence > sequence) {
+			sequence = r->sequence;
+		}
+		if (Valid(r)) {
+			active = r->parameters;
+			return true;
+		}
+		// interrupted write or outdated version, fall back to older records
+		last[page]--;
+	}
+	active = Defaults;
+	return false;
+}
+
+bool HAL::BLDC::Config::Set(const Parameters &p) {
+	if (!Check(p)) {
+		return false;
+	}
+	CriticalSection crit;
+	active = p;
+	return true;
+}
+
+static bool ErasePage(uint8_t page) {
+	FLASH_EraseInitTypeDef erase;
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.PageAddress = (uintptr_t) Slot(page, 0);
+	erase.NbPages = 1;
+	uint32_t error;
+	return HAL_FLASHEx_Erase(&erase, &error) == HAL_OK;
+}
+
+bool HAL::BLDC::Config::Save() {
+	Record r;
+	r.magic = Magic;
+	r.sequence = sequence + 1;
+	r.version = Version;
+	r.length = sizeof(Parameters);
+	r.parameters = active;
+	r.crc = CRC32(&r);
+
+	// continue in the page holding the newest record
+	uint16_t used[Pages];
+	uint8_t page = 0;
+	for (uint8_t p = 0; p < Pages; p++) {
+		used[p] = UsedSlots(p);
+		if (used[p] && Slot(p, used[p] - 1)->sequence == sequence) {
+			page = p;
+		}
+	}
+	HAL_FLASH_Unlock();
+	bool success = true;
+	uint16_t slot = used[page];
+	if (slot >= SlotsPerPage) {
+		page = (page + 1) % Pages;
+		slot = 0;
+		success = ErasePage(page);
+	}
+	const uintptr_t address = (uintptr_t) Slot(page, slot);
+	const uint32_t *data = (const uint32_t*) &r;
+	for (uint16_t i = 0; success && i < sizeof(Record) / 4; i++) {
+		success = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + i * 4,
+				data[i]) == HAL_OK;
+	}
+	HAL_FLASH_Lock();
+	// a failed write leaves a used slot that is skipped by Load()
+	sequence = r.sequence;
+	if (!success || !Valid(Slot(page, slot))) {
+		LOG_UART(Log::Lvl::Err, "Failed to save configuration");
+		return false;
+	}
+	return true;
+}
+
+bool HAL::BLDC::Config::Erase() {
+	HAL_FLASH_Unlock();
+	bool success = true;
+	for (uint8_t page = 0; page < Pages; page++) {
+		success &= ErasePage(page);
+	}
+	HAL_FLASH_Lock();
+	sequence = 0;
+	CriticalSection crit;
+	active = Defaults;
+	return success;
+}
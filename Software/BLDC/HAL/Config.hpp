@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+
+#include "StartRamp.hpp"
+#include "SpeedControl.hpp"
+#include "InductanceSensing.hpp"
+#include "Identification.hpp"
+#include "Advance.hpp"
+
+namespace HAL {
+namespace BLDC {
+namespace Config {
+
+/*
+ * Runtime configuration. The active parameters live in RAM, Save() appends
+ * them as a record with sequence number and CRC to the two flash pages
+ * reserved by the linker script. A page is only erased once the other one is
+ * full, Load() picks the newest valid record of the current Version.
+ */
+struct Parameters {
+	/* Open loop start ramp, start.motorPoles is the pole count of the motor */
+	StartRamp::Parameters start;
+	/* Phase voltage for idle tracking to see the motor turning, ADC counts */
+	uint16_t idleThreshold;
+	/* Detector blanking in samples (see Detector::SetBlanking) */
+	uint8_t blanking;
+	/* Phase voltage sampling point within the PWM period, TIM1 CCR4 */
+	uint16_t samplingOffset;
+	/* Upper duty cycle limit in promille */
+	int16_t maxPWM;
+	/* Cycle-by-cycle current limit in mA (see Driver::SetCurrentLimit) */
+	uint32_t currentLimit;
+	/* Braking current and regeneration limit (see Driver::SetBraking) */
+	uint32_t brakeCurrent;
+	uint32_t maxBusVoltage;
+	/* Torque mode gains (see Driver::SetTorqueGains) */
+	int32_t torqueKp;
+	int32_t torqueKi;
+	SpeedControl::Parameters speed;
+	/* Commutation advance curve (see Driver::SetAdvanceCurve) */
+	Advance::Point advance[Advance::MaxPoints];
+	uint8_t advancePoints;
+	/* Inductance sensing angle correction (see InductanceSensing::SetCalibration) */
+	int16_t calibration[InductanceSensing::CalibrationPoints];
+	/* Last motor identification, all zero if not identified */
+	Identification::Result motor;
+};
+
+/* Increase with every change of Parameters, older records are ignored */
+static constexpr uint16_t Version = 4;
+
+extern const Parameters Defaults;
+
+/* The active parameters */
+extern const Parameters &Active;
+
+/*
+ * Activates the newest valid record, the defaults if there is none. Call
+ * once at boot before the drivers are initialized. Returns false if no
+ * record was found.
+ */
+bool Load();
+
+/*
+ * Activates p after a range check, returns false if p was rejected. The
+ * driver takes over the new values with Driver::ApplyConfiguration().
+ */
+bool Set(const Parameters &p);
+
+/*
+ * Appends the active parameters to flash, task context only. The CPU
+ * stalls while the flash is written (up to 40ms if a page is erased), only
+ * save with the motor stopped.
+ */
+bool Save();
+
+/* Erases all records, the defaults become active */
+bool Erase();
+
+}
+}
+}
@@ -1,9 +1,11 @@
 #include "Detector.hpp"
+#include "Config.hpp"
 
 #include "stm32f3xx_hal.h"
 #include "Logging.hpp"
 #include <string.h>
 #include "lowlevel.hpp"
+#include "PowerADC.hpp"
 
 #include "fifo.hpp"
 
@@ -11,20 +13,30 @@ using namespace HAL::BLDC;
 
 static Fifo<uint16_t, 1500> buffer __attribute__ ((section (".ccmram")));;
 
-static constexpr int ADCInspectionTimeus = 50;
+// blanking time unit in us, one sample at the default PWM period
+static constexpr uint16_t BlankingUnit = 50;
+// phase voltage divider 4k7 / 1k, 3.3V reference
+static constexpr uint32_t PhaseDividerRatio10 = 57;
+static constexpr uint32_t ADCReferencemV = 3300;
 static constexpr int ADCBufferLength = 6;
 
 static uint16_t ADCBuf[ADCBufferLength];
 static uint16_t *ValidBuf = ADCBuf;
+// last sample within the on time of the PWM period
+static uint16_t OnBuf[3];
 
 extern ADC_HandleTypeDef hadc1;
 extern TIM_HandleTypeDef htim1;
 
 static uint8_t sensingPhase;
 uint32_t timeUS;
+// timer counts not yet accounted for in timeUS
+static uint16_t timeCounts;
 static uint32_t lastCrossing;
 static bool sensingActive;
 static uint32_t SkipSamples;
+// samples skipped after enabling, the commutation transient
+static uint8_t BlankingSamples = 3;
 static uint32_t crossingTime;
 static bool crossingDetected;
 static bool HysteresisValid;
@@ -39,14 +51,14 @@ static bool sampling;
 static bool idleTracking;
 static bool skipNextIdleSample;
 static HAL::BLDC::Detector::IdleCallback idleCallback;
-static constexpr uint16_t idleDetectionThreshold = 25;
+static HAL::BLDC::Detector::SampleCallback sampleCallback;
 static constexpr uint16_t idleDetectionHysterese = 15;
 
 
 void HAL::BLDC::Detector::Init() {
 	HAL_ADCEx_Calibration_Start(&hadc1, ADC_SINGLE_ENDED);
 	HAL_ADC_Start_DMA(&hadc1, (uint32_t*) ADCBuf, ADCBufferLength);
-	TIM1->CCR4 = 112;
+	SetSamplingOffset(Config::Active.samplingOffset);
 	HAL_TIM_OC_Start(&htim1, TIM_CHANNEL_4);
 	lastCrossing = 0;
 	timeUS = 0;
@@ -56,7 +68,10 @@ void HAL::BLDC::Detector::Init() {
 }
 
 void HAL::BLDC::Detector::Enable(Callback cb, uint16_t hyst) {
-	SkipSamples = 3;
+	const uint32_t blanking = (uint32_t) BlankingSamples * BlankingUnit
+			* LowLevel::CountsPerUs;
+	const uint16_t interval = LowLevel::SampleInterval();
+	SkipSamples = (blanking + interval - 1) / interval;
 	callback = cb;
 	enableTime = timeUS;
 	DetectionHysteresis = hyst;
@@ -69,12 +84,47 @@ void HAL::BLDC::Detector::Enable(Callback cb, uint16_t hyst) {
 	sensingActive = true;
 }
 
+void HAL::BLDC::Detector::SetBlanking(uint8_t samples) {
+	BlankingSamples = samples;
+}
+
+void HAL::BLDC::Detector::SetSamplingOffset(uint16_t counts) {
+	TIM1->CCR4 = counts;
+}
+
 void HAL::BLDC::Detector::Disable() {
 	sensingActive = false;
 }
 
+static void AdvanceTime() {
+	// a sample interval is not a whole number of us with center aligned PWM
+	timeCounts += LowLevel::SampleInterval();
+	timeUS += timeCounts / LowLevel::CountsPerUs;
+	timeCounts %= LowLevel::CountsPerUs;
+}
+
 static void Analyze(uint16_t *data) {
 	ValidBuf = data;
+	// counting up again after the underflow: sampled in the middle of the on
+	// time, keep it for the supply voltage
+	const bool onTime = !LowLevel::CenterAligned()
+			|| !(TIM1->CR1 & TIM_CR1_DIR);
+	if (onTime) {
+		OnBuf[0] = data[0];
+		OnBuf[1] = data[1];
+		OnBuf[2] = data[2];
+	}
+	const int32_t current = PowerADC::SynchronousSample(onTime);
+
+	if (sampleCallback) {
+		Detector::SampleSet s;
+		s.phase[0] = data[0];
+		s.phase[1] = data[1];
+		s.phase[2] = data[2];
+		s.current = current;
+		s.onTime = onTime;
+		sampleCallback(s);
+	}
 
 	if(sampling) {
 		if (buffer.getSpace()) {
@@ -87,6 +137,7 @@ static void Analyze(uint16_t *data) {
 	}
 
 	if (sensingActive) {
+		// sample clock marker, one per analyzed sample and never timestamped
 		Log::WriteChar('A');
 
 		uint16_t compare = data[sensingPhase];
@@ -105,8 +156,8 @@ static void Analyze(uint16_t *data) {
 								&& DetectRising))) {
 			HysteresisValid = true;
 			HysteresisValidTime = timeUS;
-			Log::Uart(Log::Lvl::Inf, "Hysteresis valid");
-			Log::WriteChar('H');
+			LOG_DEFER(Log::Lvl::Inf, "Hysteresis valid");
+			Log::Trace('H');
 		}
 
 		if (HysteresisValid && !crossingDetected
@@ -115,7 +166,7 @@ static void Analyze(uint16_t *data) {
 			// zero crossing detected
 			crossingTime = timeUS;
 			crossingDetected = true;
-			Log::WriteChar('C');
+			Log::Trace('C');
 		}
 
 		if (HysteresisValid
@@ -127,13 +178,13 @@ static void Analyze(uint16_t *data) {
 			uint32_t timeSinceLast = crossingTime - lastCrossing;
 			lastCrossing = crossingTime;
 			uint32_t timeSinceCrossing = timeUS - crossingTime;
-			Log::WriteChar('D');
+			Log::Trace('D');
 			if (callback) {
 				callback(timeSinceLast, timeSinceCrossing);
 			}
 
 			if (DetectionHysteresis > 0) {
-				Log::Uart(Log::Lvl::Inf, "Crossing, Hyst %d, (%lu/%lu/%lu)",
+				LOG_DEFER(Log::Lvl::Inf, "Crossing, Hyst %d, (%lu/%lu/%lu)",
 						DetectionHysteresis, HysteresisValidTime - enableTime,
 						crossingTime - enableTime, timeUS - enableTime);
 			}
@@ -153,9 +204,9 @@ static void Analyze(uint16_t *data) {
 			}
 			static bool valid = false;
 			uint8_t pos = 0;
-			if (valid && max < idleDetectionThreshold - idleDetectionHysterese) {
+			if (valid && max < Config::Active.idleThreshold - idleDetectionHysterese) {
 				valid = false;
-			} else if(!valid && max > idleDetectionThreshold + idleDetectionHysterese) {
+			} else if(!valid && max > Config::Active.idleThreshold + idleDetectionHysterese) {
 				valid = true;
 			}
 			const auto A = data[(int) Detector::Phase::A];
@@ -184,7 +235,7 @@ static void Analyze(uint16_t *data) {
 
 void HAL::BLDC::Detector::DMAComplete() {
 	Analyze(&ADCBuf[ADCBufferLength / 2]);
-	timeUS += ADCInspectionTimeus;
+	AdvanceTime();
 }
 
 void HAL::BLDC::Detector::SetPhase(Phase p, bool rising) {
@@ -194,11 +245,19 @@ void HAL::BLDC::Detector::SetPhase(Phase p, bool rising) {
 
 void HAL::BLDC::Detector::DMAHalfComplete() {
 	Analyze(&ADCBuf[0]);
-	timeUS += ADCInspectionTimeus;
+	AdvanceTime();
 }
 
 uint16_t HAL::BLDC::Detector::GetLastSample(Phase p) {
-	return ValidBuf[(int) p];
+	return OnBuf[(int) p];
+}
+
+uint32_t HAL::BLDC::Detector::SampleTomV(uint16_t sample) {
+	return (uint32_t) sample * ADCReferencemV * PhaseDividerRatio10 / 4096 / 10;
+}
+
+void HAL::BLDC::Detector::SetSampleCallback(SampleCallback cb) {
+	sampleCallback = cb;
 }
 
 bool HAL::BLDC::Detector::isEnabled() {
@@ -229,7 +288,7 @@ void HAL::BLDC::Detector::PrintBuffer() {
 		buffer.dequeue(A);
 		buffer.dequeue(B);
 		buffer.dequeue(C);
-		Log::Uart(Log::Lvl::Inf, " %d;%d;%d", A, B, C);
+		LOG_UART(Log::Lvl::Inf, " %d;%d;%d", A, B, C);
 		HAL_Delay(10);
 	}
 	buffer.clear();
@@ -21,11 +21,35 @@ void Init();
 void SetPhase(Phase p, bool rising);
 void Enable(Callback cb, uint16_t hyst = 0);
 void Disable();
+/*
+ * Time in units of 50us ignored after Enable(), defaults to 3. Converted to
+ * samples of the current PWM period.
+ */
+void SetBlanking(uint8_t samples);
+/* Phase voltage sampling point within the PWM period in TIM1 counts */
+void SetSamplingOffset(uint16_t counts);
 
 void EnableIdleTracking(IdleCallback cb);
 void DisableIdleTracking();
 
+/* Last sample, with center aligned PWM the last one taken in the on time */
 uint16_t GetLastSample(Phase p);
+/* Converts a phase voltage sample to mV */
+uint32_t SampleTomV(uint16_t sample);
+
+/* Phase voltages and bus current of the same PWM instant */
+struct SampleSet {
+	uint16_t phase[3];	// ADC counts, see SampleTomV()
+	int32_t current;	// mA, 0 without PowerADC::EnableSynchronousSampling()
+	// taken in the on time, always true with edge aligned PWM
+	bool onTime;
+};
+using SampleCallback = void(*)(const SampleSet &s);
+/*
+ * Calls cb (in DMA interrupt context) with every sample, nullptr removes the
+ * callback
+ */
+void SetSampleCallback(SampleCallback cb);
 
 void DMAComplete();
 void DMAHalfComplete();
@@ -8,126 +8,449 @@
 #include "stm32f3xx_hal.h"
 #include "stm32f303x8.h"
 #include "InductanceSensing.hpp"
+#include "PowerADC.hpp"
+#include "Advance.hpp"
+#include "StartRamp.hpp"
+#include "Predictor.hpp"
+#include "Commutation.hpp"
+#include "Config.hpp"
+#include "StateMachine.hpp"
+#include "critical.hpp"
 
 using namespace HAL::BLDC;
 
 static Driver::IncCallback IncCB;
 static void* IncPtr;
 
+static Driver::ADCCallback ADCCB;
+static void* ADCPtr;
+static uint16_t ADCDecimation = 8;
+static uint16_t ADCDecimationCnt;
+
+static volatile bool TorqueMode;
+static int32_t TorqueSetpoint;
+// duty cycle in promille, Q16
+static int32_t TorqueIntegral;
+// Current controller gains, duty cycle in promille per A (P) and per As (I)
+// Integral increase per mA error and measurement block (125us), Q16
+static constexpr int32_t TorqueKiBlock(int32_t ki) {
+	return (int64_t) ki * 65536 * 125 / 1000000 / 1000;
+}
+static int32_t torqueKp;
+static int32_t torqueKiBlock;
+
+// duty cycle in promille (Q16) as used by the current controllers
+static int32_t DutyToPromille(uint16_t duty) {
+	return (int64_t) duty * 1000 * 65536 / LowLevel::DutyOne;
+}
+
 static uint8_t CommutationStep;
 
 
 
-static Driver::State state;
-static uint32_t StartTime;
-static uint16_t StartSteps;
+enum class Event : uint8_t {
+	// task context
+	Start,
+	FreeRun,
+	Brake,
+	Reset,
+	// timer
+	StartStep,
+	SenseAgain,
+	Commutate,
+	Flywheel,
+	Stall,
+	Recover,
+	Release,
+	// inductance sensing
+	Sensed,
+	Resensed,
+	// detector
+	Crossing,
+	Turning,
+	Halted,
+	Reverse,
+	Probe,
+	BrakeEnd,
+	// internal
+	GiveUp,
+};
+
+using Machine = StateMachine<Driver::State, Event, 6, CriticalSection>;
 
-static constexpr uint32_t StartSequenceLength = 140000; //sizeof(StartSequence)/sizeof(StartSequence[0]);
-static constexpr uint32_t StartFinalRPM = 800;
-static constexpr uint8_t MotorPoles = 12;
-static constexpr uint32_t StartMaxPeriod = 10000;
-static constexpr uint16_t StartFinalPWM = 101;
-static constexpr uint16_t StartMinPWM = 100;
+static void Post(Event e, uint32_t arg0 = 0, uint32_t arg1 = 0);
+static Driver::State State();
 
-static uint32_t StartSequence(uint32_t time) {
-	constexpr uint32_t FinalPeriod = 1000000UL
-			/ (StartFinalRPM * 6 * MotorPoles / 2 / 60);
-	constexpr uint64_t dividend = FinalPeriod * StartSequenceLength;
-	uint64_t period = dividend / time;
-	if (time == 0 || period > StartMaxPeriod)
-		return StartMaxPeriod;
-	else
-		return period;
+// timer callback posting an event
+template<Event e>
+static void Signal() {
+	Post(e);
 }
 
-static uint16_t StartPWM(uint32_t time) {
-	constexpr uint32_t divisor = StartSequenceLength / (StartFinalPWM - StartMinPWM);
-	return StartMinPWM + time / divisor;
+static uint32_t StartTime;
+static uint16_t StartSteps;
+
+// start ramp generated from the configuration by ApplyConfiguration()
+static uint16_t startPeriod[StartRamp::MaxSteps];
+static uint16_t startPWM[StartRamp::MaxSteps];
+static uint16_t startLength;
+
+// commutation period of the given start step, the last one beyond the ramp
+static uint32_t StartSequence(uint16_t step) {
+	if (step >= startLength) {
+		step = startLength - 1;
+	}
+	return startPeriod[step];
 }
 
 static uint32_t timeBetweenCommutations;
 
+// Supervision: a crossing has to arrive within CrossingTimeoutSteps
+// commutation intervals and within the gate of the predictor
+static constexpr uint8_t CrossingTimeoutSteps = 2;
+static constexpr uint32_t MinCrossingTimeout = 1000;
+// one electrical revolution without an accepted crossing indicates a desync
+static constexpr uint8_t MaxAnomalies = 6;
+// restart attempts, reset after StableCrossings accepted crossings
+static constexpr uint8_t MaxRestarts = 3;
+static constexpr uint16_t StableCrossings = 600;
+// time to coast before deciding between re-catch and restart
+static constexpr uint32_t CoastTime = 50000;
+static constexpr uint32_t AlignTime = 1000000;
+// inductance sensing sequences averaged per measurement and repeated measurements
+static constexpr uint8_t PositionAverages = 4;
+static constexpr uint8_t PositionRetries = 2;
+
+// Sensed start: the torque producing step is driven for SensedDriveTime, then
+// the rotor angle is sensed again. The open loop ramp takes over at the step
+// matching the speed once a step takes less than SensedHandoverPeriod.
+static constexpr uint32_t SensedDriveTime = 2000;
+// limited by the cycle-by-cycle current limit
+static constexpr uint16_t SensedPWM = 200;
+static constexpr uint32_t SensedHandoverPeriod = 4000;
+static constexpr uint8_t SensedFastIntervals = 2;
+static constexpr uint8_t SensedMaxMisses = 3;
+static constexpr uint32_t SensedTimeout = 3000000;
+// one commutation step in 1/65536 turn
+static constexpr uint16_t StepAngle = 65536 / 6;
+
+static Driver::StartMode startMode = Driver::StartMode::Ramp;
+
+// Reversal: coast for ReverseProbeTime, then brake in slices of
+// ReverseBrakeTime until idle tracking loses the rotor
+static constexpr uint32_t ReverseProbeTime = 1000;
+static constexpr uint32_t ReverseBrakeTime = 10000;
+
+static Driver::Direction direction = Driver::Direction::Forward;
+static uint32_t reversalStart;
+
+// Commutated braking: winding current in mA, 0 shorts the phases instead
+static uint32_t brakeCurrent;
+static uint32_t maxBusVoltage;
+// regeneration limit of the current stop in mV, 0 until the supply is known
+static uint32_t busLimit;
+static constexpr uint32_t BusMargin = 500;
+// duty cycle in promille, Q16
+static int32_t BrakeIntegral;
+// the supply is visible from this duty cycle above the sampling point
+static constexpr uint16_t BusSampleMargin = 32;
+static constexpr uint32_t ShortBrakeTime = 500000;
+static constexpr uint32_t FinalBrakeTime = 100000;
+
+// PWM frequency schedule: TIM1 period per level, the commutation period in
+// us below which the next level is used and the hysteresis to switch back
+static constexpr uint16_t PWMPeriods[] = { 3200, 1600, 800 };
+static constexpr uint32_t PWMUpshift[] = { 2000, 400 };
+static constexpr uint8_t PWMLevels = sizeof(PWMPeriods) / sizeof(PWMPeriods[0]);
+static constexpr uint8_t DefaultPWMLevel = 1;
+static constexpr uint8_t PWMHysteresis = 8;
+static_assert(PWMPeriods[DefaultPWMLevel] == LowLevel::DefaultPeriod,
+		"Starts are tuned for the default PWM period");
+static bool adaptivePWM;
+static uint8_t pwmLevel = DefaultPWMLevel;
+
+// commutation period seen by idle tracking while coasting
+static uint32_t idlePeriod;
+static uint32_t idleStepTime;
+static bool idleValid;
+static bool idleDirectionKnown;
+static Driver::Direction idleDirection;
+static uint32_t sensedStartTime;
+static uint32_t sensedTime;
+static uint16_t sensedAngle;
+static uint8_t sensedFine;
+static uint8_t sensedFast;
+static uint8_t sensedMisses;
+
+static uint8_t anomalies;
+static uint16_t validCrossings;
+static uint8_t restarts;
+// automatic recovery scheduled by Coast()
+static bool recovering;
+static Driver::Statistics stats;
+
 static void CrossingCallback(uint32_t usSinceLast, uint32_t timeSinceCrossing);
+static void Coast();
+static void Idle();
+static void NextStartStep();
+static void IdleTrackingCB(uint8_t pos, bool valid);
+static void TrackIdle();
+static void SetAllPhases(LowLevel::State s);
+static void ReversalDone();
+static bool Reversed() {
+	return direction == Driver::Direction::Reverse;
+}
+
+// following and preceding step in the direction of rotation
+static uint8_t Next(uint8_t step) {
+	return (step + (Reversed() ? 5 : 1)) % 6;
+}
+
+static uint8_t Previous(uint8_t step) {
+	return (step + (Reversed() ? 1 : 5)) % 6;
+}
+
 static void SetStep(uint8_t step) {
 //	HAL_GPIO_WritePin(TRIGGER_GPIO_Port, TRIGGER_Pin, GPIO_PIN_SET);
 //	HAL_GPIO_TogglePin(TRIGGER_GPIO_Port, TRIGGER_Pin);
-	switch (step) {
-	case 0:
-		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::High);
-		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
-		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Low);
-		Detector::SetPhase(Detector::Phase::B, true);
-		break;
-	case 1:
-		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
-		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::High);
-		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Low);
-		Detector::SetPhase(Detector::Phase::A, false);
-		break;
-	case 2:
-		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Low);
-		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::High);
-		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
-		Detector::SetPhase(Detector::Phase::C, true);
-		break;
-	case 3:
-		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Low);
-		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
-		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::High);
-		Detector::SetPhase(Detector::Phase::B, false);
-		break;
-	case 4:
-		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
-		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Low);
-		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::High);
-		Detector::SetPhase(Detector::Phase::A, true);
-		break;
-	case 5:
-		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::High);
-		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Low);
-		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
-		Detector::SetPhase(Detector::Phase::C, false);
-		break;
-	}
-
-	if (state == Driver::State::Running) {
-		uint32_t timeout = 20000;
-		if(timeBetweenCommutations * 5 > timeout) {
-			timeout = timeBetweenCommutations * 5;
-		}
-//		Timer::Schedule(timeout,
-//				[]() {
-//					Log::WriteChar('T');
+	Commutation::SetStep(step, Reversed());
 
-//					Detector::Disable();
-//					LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
-//					LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
-//					LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
-//
-//					state = Driver::State::Stopped;
-//					Log::Uart(Log::Lvl::Err, "Timed out while waiting for commutation, motor stopped");
-//					Timer::Schedule(100000, [](){
-//
-//					});
-//		});
+	const Driver::State s = State();
+	if (s == Driver::State::Running || s == Driver::State::Braking) {
+		// the timer is free until the crossing schedules the next commutation
+		uint32_t timeout = timeBetweenCommutations * CrossingTimeoutSteps;
+		if (timeout < MinCrossingTimeout) {
+			timeout = MinCrossingTimeout;
+		}
+		Timer::Schedule(timeout, Signal<Event::Stall>);
 	}
 }
 
-static void NextStartStep() {
-	Log::WriteChar('N');
+static void ResetSupervision() {
+	anomalies = 0;
+	validCrossings = 0;
+}
 
-//	Log::Uart(Log::Lvl::Dbg, "Start step %d", StartStep);
-	CommutationStep = (CommutationStep + 1) % 6;
+static void Align() {
+	// rotor position unknown, align to the current step before starting
+	LowLevel::SetPWM(30);
 	Detector::Disable();
 	SetStep(CommutationStep);
-	if(state == Driver::State::Running) {
-		// Successfully started, enter normal operation mode
-		Detector::Enable(CrossingCallback);
+	Timer::Schedule(AlignTime, Signal<Event::StartStep>);
+}
+
+// Torque producing step in 30° resolution, sector n is best served by
+// step (8 - n) % 6 forward and the opposite field in reverse. Odd fine steps
+// lie halfway between two steps.
+static uint8_t TorqueStep(uint16_t angle) {
+	const uint8_t fine = (27 - (((uint32_t) angle * 12 + 32768) >> 16)) % 12;
+	return Reversed() ? (fine + 6) % 12 : fine;
+}
+
+// step to continue with from a fine step, the one already passed if it is a
+// half step
+static uint8_t FirstStep(uint8_t fine) {
+	return (Reversed() ? fine + 1 : fine) / 2 % 6;
+}
+
+// inductance sensing results are posted with sector and confidence in arg0
+// and the angle in arg1
+static void PostResult(Event e, InductanceSensing::Result r) {
+	Post(e, r.sector | (uint32_t) r.confidence << 16, r.angle);
+}
+
+static InductanceSensing::Result Unpack(const Machine::Message &m) {
+	InductanceSensing::Result r;
+	r.sector = m.arg0;
+	r.confidence = m.arg0 >> 16;
+	r.angle = m.arg1;
+	return r;
+}
+
+static void PositionCallback(InductanceSensing::Result r) {
+	PostResult(Event::Sensed, r);
+}
+
+static void ResenseCallback(InductanceSensing::Result r) {
+	PostResult(Event::Resensed, r);
+}
+
+static void SenseAgain() {
+	if (!InductanceSensing::Start(ResenseCallback, 1, 1, false)) {
+		Align();
+	}
+}
+
+static void SensedDrive(uint8_t fine) {
+	sensedFine = fine;
+	LowLevel::SetPWM(SensedPWM);
+	Commutation::SetFineStep(fine);
+	Timer::Schedule(SensedDriveTime, Signal<Event::SenseAgain>);
+}
+
+static void SensedHandover(uint32_t now, uint32_t period, uint16_t angle) {
+	uint16_t step = 0;
+	while (step < startLength - 1 && startPeriod[step] > period) {
+		step++;
+	}
+	LOG_DEFER(Log::Lvl::Inf, "Sensed start handover after %luus (%luus/step)",
+			now - sensedStartTime, period);
+	StartSteps = step;
+	StartTime = now - sensedStartTime;
+	CommutationStep = Previous(FirstStep(TorqueStep(angle)));
+	NextStartStep();
+}
+
+static void SensedStep(InductanceSensing::Result r) {
+	const uint32_t now = Timer::Micros();
+	if (!r.sector || r.confidence < InductanceSensing::MinConfidence) {
+		if (++sensedMisses > SensedMaxMisses) {
+			LOG_DEFER(Log::Lvl::Wrn, "Lost rotor position, aligning");
+			Align();
+			return;
+		}
+		// keep pushing in the same direction
+		SensedDrive(sensedFine);
+		return;
+	}
+	sensedMisses = 0;
+
+	uint16_t angle = r.angle;
+	if (sensedTime) {
+		// the rotor turns towards lower angles when running forward
+		const int16_t travel =
+				Reversed() ? r.angle - sensedAngle : sensedAngle - r.angle;
+		const uint32_t interval = now - sensedTime;
+		if (travel > 0) {
+			const uint32_t period = interval * StepAngle / travel;
+			if (period <= SensedHandoverPeriod) {
+				if (++sensedFast >= SensedFastIntervals) {
+					SensedHandover(now, period, r.angle);
+					return;
+				}
+			} else {
+				sensedFast = 0;
+			}
+			// aim at the angle in the middle of the next drive interval
+			const int32_t ahead = (int32_t) travel * (SensedDriveTime / 2)
+					/ interval;
+			angle = Reversed() ? angle + ahead : angle - ahead;
+		} else {
+			sensedFast = 0;
+		}
+	}
+	sensedAngle = r.angle;
+	sensedTime = now;
+	SensedDrive(TorqueStep(angle));
+}
+
+static void PositionSensed(InductanceSensing::Result r) {
+	if (!r.sector || r.confidence < InductanceSensing::MinConfidence) {
+		LOG_DEFER(Log::Lvl::Wrn, "Rotor position unknown (%d/%d), aligning",
+				r.sector, r.confidence);
+		Align();
+		return;
+	}
+	LOG_DEFER(Log::Lvl::Dbg, "Rotor at %lu° (%d)",
+			(uint32_t) r.angle * 360 / 65536, r.confidence);
+	if (startMode == Driver::StartMode::Sensed) {
+		sensedStartTime = Timer::Micros();
+		sensedTime = 0;
+		sensedFast = 0;
+		sensedMisses = 0;
+		SensedStep(r);
+		return;
+	}
+	LowLevel::SetPWM(100);
+	const uint8_t fine = TorqueStep(r.angle);
+	if (fine & 0x01) {
+		// energize all three phases for the first half step
+		CommutationStep = FirstStep(fine);
+		Detector::Disable();
+		Commutation::SetHalfStep(fine / 2);
+		const uint32_t length = startPeriod[0] / 2;
+		StartTime += length;
+		Timer::Schedule(length, Signal<Event::StartStep>);
+	} else {
+		// rotor position determined, modify next commutation step accordingly
+		CommutationStep = Previous(fine / 2);
+		NextStartStep();
+	}
+}
+
+static void SetPWMLevel(uint8_t level) {
+	pwmLevel = level;
+	LowLevel::SetPeriod(PWMPeriods[level]);
+}
+
+static void AdaptPWM() {
+	if (!adaptivePWM) {
+		return;
+	}
+	uint8_t level = pwmLevel;
+	if (level + 1 < PWMLevels && timeBetweenCommutations < PWMUpshift[level]) {
+		level++;
+	} else if (level > 0 && timeBetweenCommutations > PWMUpshift[level - 1]
+			+ PWMUpshift[level - 1] / PWMHysteresis) {
+		level--;
+	}
+	if (level != pwmLevel) {
+		SetPWMLevel(level);
+	}
+}
+
+static void SenseAndStart() {
+	StartTime = 0;
+	StartSteps = 0;
+	SetPWMLevel(DefaultPWMLevel);
+	if (!InductanceSensing::Start(PositionCallback, PositionAverages,
+			PositionRetries)) {
+		Align();
+	}
+}
+
+static void Repower() {
+	timeBetweenCommutations = 100000;
+	ResetSupervision();
+	// in both directions, the back EMF changes sign with the direction
+	CommutationStep = (CommutationStep + 2) % 6;
+	LowLevel::SetPWM(Config::Active.start.finalPWM);
+	SetStep(CommutationStep);
+	Detector::DisableIdleTracking();
+	Predictor::Reset(0);
+	Detector::Enable(CrossingCallback);
+}
+
+// Entered Stopping after a failure, recovers after CoastTime
+static void Coast() {
+	reversalStart = 0;
+	InductanceSensing::Abort();
+	Timer::Abort();
+	Detector::Disable();
+	Idle();
+	TrackIdle();
+	if (restarts >= MaxRestarts) {
+		LOG_DEFER(Log::Lvl::Err, "Unable to recover after %d restarts, motor stopped",
+				restarts);
+		recovering = false;
+		Post(Event::GiveUp);
 		return;
 	}
+	recovering = true;
+	Timer::Schedule(CoastTime, Signal<Event::Recover>);
+}
+
+static void NextStartStep() {
+	Log::Trace('N');
+
+//	LOG_UART(Log::Lvl::Dbg, "Start step %d", StartStep);
+	CommutationStep = Next(CommutationStep);
+	Detector::Disable();
+	SetStep(CommutationStep);
+
 	// Schedule next start step
-	auto length = StartSequence(StartTime);
-	LowLevel::SetPWM(StartPWM(StartTime));
+	const uint32_t length = startPeriod[StartSteps];
+	LowLevel::SetPWM(startPWM[StartSteps]);
 	StartTime += length;
 
 	if(StartSteps >= 10) {
@@ -135,140 +458,802 @@ static void NextStartStep() {
 	}
 	StartSteps++;
 
-	if (StartTime >= StartSequenceLength) {
-		// TODO Start attempt failed
-		Detector::Disable();
-		Log::Uart(Log::Lvl::Err, "Failed to start motor");
-		LowLevel::SetPWM(0);
-		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
-		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
-		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
-		state = Driver::State::Stopped;
-		return;
-	}
+	Timer::Schedule(length, Signal<Event::StartStep>);
+}
 
-	Timer::Schedule(length, NextStartStep);
+static void Commutate() {
+	Log::Trace('M');
+	// the new period takes over within the first PWM period of the step
+	AdaptPWM();
+	SetStep(CommutationStep);
+	Detector::Enable(CrossingCallback);
+}
+
+static void FlywheelCommutation() {
+	// no usable crossing in this step, commutate on the prediction
+	Predictor::Coast();
+	anomalies++;
+	CommutationStep = Next(CommutationStep);
+	Commutate();
 }
 
 static void CrossingCallback(uint32_t usSinceLast, uint32_t timeSinceCrossing) {
-	Log::WriteChar('B');
-	UNUSED(timeSinceCrossing);
+	Log::Trace('B');
 //	HAL_GPIO_WritePin(TRIGGER_GPIO_Port, TRIGGER_Pin, GPIO_PIN_RESET);
-	if (state == Driver::State::Starting) {
-		state = Driver::State::Running;
-		Log::Uart(Log::Lvl::Inf, "Motor started after %luus", StartTime);
-		Detector::Disable();
-		timeBetweenCommutations = StartSequence(StartTime);
-//		return;
-		// abort next scheduled start step
-		Timer::Abort();
-		LowLevel::SetPWM(100);
-		// no previous commutation known, take a guess from the start sequence
-		usSinceLast = StartSequence(StartTime);
-//		timeSinceCrossing = StartSequence(StartTime) / 2;
-	} else if (IncCB) {
-		// motor is already running, report back crossing intervals to controller
-		IncCB(IncPtr, usSinceLast);
-	}
-
-	// Disable detector until next commutation step
+	// Disable detector until the crossing is processed
 	Detector::Disable();
-	CommutationStep = (CommutationStep + 1) % 6;
-	// Calculate time until next 30° rotation
-	uint32_t TimeToNextCommutation = usSinceLast / 2;// - timeSinceCrossing;
-	Timer::Schedule(TimeToNextCommutation, []() {
-		Log::WriteChar('M');
-		SetStep(CommutationStep);
+	Post(Event::Crossing, Timer::Micros() - timeSinceCrossing, usSinceLast);
+}
+
+static void ProcessCrossing(uint32_t crossingTime, uint32_t usSinceLast,
+		bool report) {
+	const uint32_t now = Timer::Micros();
+	if (!Predictor::Update(crossingTime, usSinceLast)) {
+		// outside the gate, most likely noise: keep listening for the real
+		// crossing and commutate on the prediction in case it does not show up
+		Log::Trace('R');
+		stats.anomalies++;
+		validCrossings = 0;
+		const uint32_t period = Predictor::Period();
 		Detector::Enable(CrossingCallback);
-	});
-//	Log::Uart(Log::Lvl::Inf, "next comm in %luus", TimeToNextCommutation);
+		Timer::Schedule(
+				Advance::CommutationDelay(period,
+						Predictor::SinceCrossing(now) - (int32_t) period),
+				Signal<Event::Flywheel>);
+		return;
+	}
+	anomalies = 0;
+	if (++validCrossings >= StableCrossings) {
+		validCrossings = 0;
+		restarts = 0;
+	}
+	if (IncCB && report) {
+		// motor is running, report back crossing intervals to controller
+		IncCB(IncPtr, Predictor::Period());
+	}
 
-	timeBetweenCommutations = usSinceLast;
+	CommutationStep = Next(CommutationStep);
+	// Calculate time until next 30° rotation minus advance from the filtered crossing
+	timeBetweenCommutations = Predictor::Period();
+	Timer::Schedule(
+			Advance::CommutationDelay(timeBetweenCommutations,
+					Predictor::SinceCrossing(now)), Signal<Event::Commutate>);
+//	LOG_UART(Log::Lvl::Inf, "next comm in %luus", TimeToNextCommutation);
 }
 
 static void IdleTrackingCB(uint8_t pos, bool valid) {
+	if (pos != CommutationStep) {
+		const uint32_t now = Timer::Micros();
+		if (idleStepTime) {
+			idlePeriod = now - idleStepTime;
+			// the position advances by one step in the direction of rotation
+			idleDirectionKnown = true;
+			if (pos == (CommutationStep + 1) % 6) {
+				idleDirection = Driver::Direction::Forward;
+			} else if (pos == (CommutationStep + 5) % 6) {
+				idleDirection = Driver::Direction::Reverse;
+			} else {
+				idleDirectionKnown = false;
+			}
+		}
+		idleStepTime = now;
+	}
+	if (!valid) {
+		idlePeriod = 0;
+		idleDirectionKnown = false;
+	}
+	idleValid = valid;
 	CommutationStep = pos;
-	if(!valid && state != Driver::State::Stopped) {
-		// motor is running too slow for idle tracking, consider it stopped
-		state = Driver::State::Stopped;
-		Log::Uart(Log::Lvl::Inf, "...stopped");
-	} else if(valid && state == Driver::State::Stopped) {
-		state = Driver::State::Stopping;
-		Log::Uart(Log::Lvl::Inf, "Motor started by external force");
+	// only post changes, the state machine ignores them in the other states
+	const Driver::State s = State();
+	if (!valid && s == Driver::State::Stopping) {
+		Post(Event::Halted);
+	} else if (valid && s == Driver::State::Stopped) {
+		Post(Event::Turning);
 	}
 }
 
-HAL::BLDC::Driver::Driver() {
-	LowLevel::SetPWM(0);
-	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
-	LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
-	LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
+static void TrackIdle() {
+	idlePeriod = 0;
+	idleStepTime = 0;
+	idleValid = false;
+	idleDirectionKnown = false;
+	Detector::EnableIdleTracking(IdleTrackingCB);
+}
+
+/*
+ * Transition actions and guards
+ */
+using Message = Machine::Message;
+
+static void OnStart(const Message&) {
+	LOG_DEFER(Log::Lvl::Inf, "Initiating start sequence");
+	Detector::DisableIdleTracking();
+	recovering = false;
+	restarts = 0;
+	stats.starts++;
+	// continues in PositionSensed() once the rotor position is known
+	SenseAndStart();
+}
+
+static void OnRepower(const Message&) {
+	LOG_DEFER(Log::Lvl::Inf, "Repower idling motor");
+	// abort a pending automatic recovery
+	Timer::Abort();
+	recovering = false;
+	restarts = 0;
+	Repower();
+}
 
+static void OnFreeRun(const Message&) {
+	reversalStart = 0;
+	InductanceSensing::Abort();
+	Timer::Abort();
 	Detector::Disable();
+	Idle();
+	recovering = false;
+	TrackIdle();
+}
 
+static void OnBrake(const Message&) {
+	reversalStart = 0;
+	InductanceSensing::Abort();
+	Timer::Abort();
+	Detector::Disable();
+	recovering = false;
+	SetAllPhases(LowLevel::State::Low);
+	Timer::Schedule(ShortBrakeTime, Signal<Event::Release>);
+}
+
+static void OnRelease(const Message&) {
+	Idle();
+}
+
+static void OnReset(const Message&) {
+	reversalStart = 0;
+	InductanceSensing::Abort();
+	Timer::Abort();
+	Detector::Disable();
+	Idle();
+	recovering = false;
 	CommutationStep = 0;
+	TrackIdle();
+}
 
-	state = State::Stopped;
+static void OnSensed(const Message &m) {
+	PositionSensed(Unpack(m));
+}
 
-	Detector::EnableIdleTracking(IdleTrackingCB);
+static bool SensedTimedOut(const Message&) {
+	return Timer::Micros() - sensedStartTime > SensedTimeout;
+}
+
+static void OnSensedStartFailed(const Message&) {
+	LOG_DEFER(Log::Lvl::Err, "Failed to start motor (sensed)");
+	stats.failedStarts++;
+	Coast();
+}
+
+static void OnResensed(const Message &m) {
+	SensedStep(Unpack(m));
+}
+
+static void OnSenseAgain(const Message&) {
+	SenseAgain();
+}
+
+static bool RampEnded(const Message&) {
+	return StartSteps >= startLength;
+}
+
+static void OnStartFailed(const Message&) {
+	LOG_DEFER(Log::Lvl::Err, "Failed to start motor");
+	stats.failedStarts++;
+	Coast();
+}
+
+static void OnStartStep(const Message&) {
+	NextStartStep();
+}
+
+static void OnStarted(const Message &m) {
+	LOG_DEFER(Log::Lvl::Inf, "Motor started after %luus", StartTime);
+	stats.lastStartTime = StartTime;
+	ResetSupervision();
+	timeBetweenCommutations = StartSequence(StartSteps);
+	// abort next scheduled start step
+	Timer::Abort();
+	LowLevel::SetPWM(100);
+	// no previous commutation known, take a guess from the start sequence
+	Predictor::Reset(StartSequence(StartSteps));
+	ProcessCrossing(m.arg0, m.arg1, false);
+	ReversalDone();
+}
+
+static void OnCrossing(const Message &m) {
+	ProcessCrossing(m.arg0, m.arg1, true);
+}
+
+static void OnBrakeCrossing(const Message &m) {
+	// the brake controller owns the duty cycle, keep the speed controller out
+	ProcessCrossing(m.arg0, m.arg1, false);
+}
+
+static void OnCommutate(const Message&) {
+	Commutate();
+}
+
+// one electrical revolution without an accepted crossing
+static bool Desynced(const Message&) {
+	return anomalies + 1 >= MaxAnomalies;
+}
+
+static void OnDesync(const Message&) {
+	Predictor::Coast();
+	LOG_DEFER(Log::Lvl::Err, "Lost synchronization (expected %luus)",
+			Predictor::Period());
+	stats.desyncs++;
+	Coast();
+}
+
+static void OnFlywheel(const Message&) {
+	FlywheelCommutation();
+}
+
+static void OnStall(const Message&) {
+	Log::Trace('T');
+	LOG_DEFER(Log::Lvl::Err, "No crossing within %luus, motor stalled",
+			timeBetweenCommutations * CrossingTimeoutSteps);
+	stats.stalls++;
+	Coast();
+}
+
+static bool Recovering(const Message&) {
+	return recovering;
+}
+
+static void OnRecatch(const Message&) {
+	// idle tracking still sees the motor turning
+	LOG_DEFER(Log::Lvl::Inf, "Re-catching coasting motor");
+	recovering = false;
+	stats.recatches++;
+	Repower();
+}
+
+static void OnRestart(const Message&) {
+	recovering = false;
+	restarts++;
+	stats.restarts++;
+	LOG_DEFER(Log::Lvl::Inf, "Restarting motor (%d)", restarts);
+	Detector::DisableIdleTracking();
+	stats.starts++;
+	SenseAndStart();
+}
+
+static void OnHalted(const Message&) {
+	// motor is running too slow for idle tracking, consider it stopped
+	LOG_DEFER(Log::Lvl::Inf, "...stopped");
+}
+
+static void OnTurning(const Message&) {
+	LOG_DEFER(Log::Lvl::Inf, "Motor started by external force");
+}
+
+static void SetAllPhases(LowLevel::State s) {
+	LowLevel::SetPhase(LowLevel::Phase::A, s);
+	LowLevel::SetPhase(LowLevel::Phase::B, s);
+	LowLevel::SetPhase(LowLevel::Phase::C, s);
+}
+
+static void ReversalDone() {
+	if (reversalStart) {
+		stats.lastReversalTime = Timer::Micros() - reversalStart;
+		reversalStart = 0;
+	}
+}
+
+static void OnSetDirection(const Message &m) {
+	direction = (Driver::Direction) m.arg0;
+}
+
+static void BeginReversal() {
+	stats.reversals++;
+	reversalStart = Timer::Micros();
+	InductanceSensing::Abort();
+	Timer::Abort();
+	Detector::Disable();
+	Idle();
+	recovering = false;
+	// coast briefly to see speed and direction
+	TrackIdle();
+	Timer::Schedule(ReverseProbeTime, Signal<Event::Probe>);
+}
+
+static void OnReverse(const Message &m) {
+	direction = (Driver::Direction) m.arg0;
+	LOG_DEFER(Log::Lvl::Inf, "Reversing motor");
+	BeginReversal();
+}
+
+static bool TurningNewWay(const Message&) {
+	return idleValid && idleDirectionKnown && idleDirection == direction;
+}
+
+// repowering walks the steps in the set direction, that would plug a rotor
+// coasting the other way after SetDirection()
+static bool TurningOldWay(const Message&) {
+	return idleValid && idleDirectionKnown && idleDirection != direction;
+}
+
+static bool RecoveringOldWay(const Message &m) {
+	return recovering && TurningOldWay(m);
+}
+
+static void OnReverseCoasting(const Message&) {
+	LOG_DEFER(Log::Lvl::Inf, "Motor coasting the other way, reversing");
+	BeginReversal();
+}
+
+static bool StillTurning(const Message&) {
+	return idleValid;
+}
+
+/*
+ * Shorted windings carry back EMF / R in the low side switches, outside the
+ * shunt and the current limit. The slices only start once that is within the
+ * current limit, without an identified motor at the speed the start ramp hands
+ * over at (as for braking).
+ */
+static uint32_t SafeShortPeriod() {
+	const Identification::Result &motor = Config::Active.motor;
+	const uint32_t limit = Config::Active.currentLimit;
+	if (!motor.ke || !motor.resistance || !limit) {
+		return StartRamp::FinalPeriod(Config::Active.start);
+	}
+	// 10^7 / period eRPM, ke in uV per eRPM, resistance in mOhm
+	return (uint64_t) motor.ke * 10000000 / ((uint64_t) motor.resistance * limit);
+}
+
+static bool TooFastToShort(const Message&) {
+	// idlePeriod is 0 until the second step, assume the worst
+	return idleValid && idlePeriod < SafeShortPeriod();
 }
 
+static void OnCoastSlice(const Message&) {
+	// keep coasting, idle tracking stays active
+	Timer::Schedule(ReverseBrakeTime, Signal<Event::Probe>);
+}
+
+static void OnRecatchReversed(const Message&) {
+	LOG_DEFER(Log::Lvl::Inf, "Re-catching motor in the new direction");
+	Repower();
+	ReversalDone();
+}
+
+static void OnBrakeSlice(const Message&) {
+	// shorted windings decelerate the rotor, idle tracking is blind meanwhile
+	Detector::DisableIdleTracking();
+	SetAllPhases(LowLevel::State::Low);
+	Timer::Schedule(ReverseBrakeTime, Signal<Event::BrakeEnd>);
+}
+
+static void OnBrakeEnd(const Message&) {
+	SetAllPhases(LowLevel::State::Idle);
+	TrackIdle();
+	Timer::Schedule(ReverseProbeTime, Signal<Event::Probe>);
+}
+
+static void OnReverseStart(const Message &m) {
+	// too slow for idle tracking, close enough to standstill for a start
+	OnStart(m);
+}
+
+static bool CommutatedBrake(const Message&) {
+	return brakeCurrent;
+}
+
+static void OnBrakeStart(const Message&) {
+	LOG_DEFER(Log::Lvl::Inf, "Braking with %lumA", brakeCurrent);
+	// the running duty cycle drives little current, start braking from there
+	BrakeIntegral = DutyToPromille(LowLevel::GetDuty());
+	busLimit = maxBusVoltage;
+}
+
+// crossings get unreliable below the speed the start ramp hands over at
+static bool BrakeDone(const Message&) {
+	return timeBetweenCommutations > StartRamp::FinalPeriod(Config::Active.start);
+}
+
+static void OnBrakeFinish(const Message&) {
+	LOG_DEFER(Log::Lvl::Inf, "Braked to %luus per step, shorting phases",
+			timeBetweenCommutations);
+	Timer::Abort();
+	Detector::Disable();
+	SetAllPhases(LowLevel::State::Low);
+	Timer::Schedule(FinalBrakeTime, Signal<Event::Release>);
+}
+
+static void OnBrakeCancel(const Message&) {
+	// still commutated, the duty cycle is taken over from the brake
+	LOG_DEFER(Log::Lvl::Inf, "Braking cancelled");
+}
+
+using S = Driver::State;
+
+static const Machine::Transition Transitions[] = {
+	// from			event				guard			to				action
+	{ S::Stopped,	Event::Start,		nullptr,		S::Starting,	OnStart },
+	{ S::Stopped,	Event::Recover,		Recovering,		S::Starting,	OnRestart },
+	{ S::Stopped,	Event::Turning,		nullptr,		S::Stopping,	OnTurning },
+	{ S::Stopped,	Event::Release,		nullptr,		S::Stopped,		OnRelease },
+	{ S::Stopped,	Event::FreeRun,		nullptr,		S::Stopped,		OnFreeRun },
+	{ S::Stopped,	Event::Brake,		nullptr,		S::Stopped,		OnBrake },
+	{ S::Stopped,	Event::Reset,		nullptr,		S::Stopped,		OnReset },
+	{ S::Stopped,	Event::Reverse,		nullptr,		S::Stopped,		OnSetDirection },
+
+	{ S::Starting,	Event::Sensed,		nullptr,		S::Starting,	OnSensed },
+	{ S::Starting,	Event::Resensed,	SensedTimedOut,	S::Stopping,	OnSensedStartFailed },
+	{ S::Starting,	Event::Resensed,	nullptr,		S::Starting,	OnResensed },
+	{ S::Starting,	Event::SenseAgain,	nullptr,		S::Starting,	OnSenseAgain },
+	{ S::Starting,	Event::StartStep,	RampEnded,		S::Stopping,	OnStartFailed },
+	{ S::Starting,	Event::StartStep,	nullptr,		S::Starting,	OnStartStep },
+	{ S::Starting,	Event::Crossing,	nullptr,		S::Running,		OnStarted },
+	{ S::Starting,	Event::FreeRun,		nullptr,		S::Stopping,	OnFreeRun },
+	{ S::Starting,	Event::Brake,		nullptr,		S::Stopped,		OnBrake },
+	{ S::Starting,	Event::Reset,		nullptr,		S::Stopped,		OnReset },
+	{ S::Starting,	Event::Reverse,		nullptr,		S::Reversing,	OnReverse },
+
+	{ S::Running,	Event::Crossing,	nullptr,		S::Running,		OnCrossing },
+	{ S::Running,	Event::Commutate,	nullptr,		S::Running,		OnCommutate },
+	{ S::Running,	Event::Flywheel,	Desynced,		S::Stopping,	OnDesync },
+	{ S::Running,	Event::Flywheel,	nullptr,		S::Running,		OnFlywheel },
+	{ S::Running,	Event::Stall,		nullptr,		S::Stopping,	OnStall },
+	{ S::Running,	Event::FreeRun,		nullptr,		S::Stopping,	OnFreeRun },
+	{ S::Running,	Event::Brake,		CommutatedBrake,	S::Braking,	OnBrakeStart },
+	{ S::Running,	Event::Brake,		nullptr,		S::Stopped,		OnBrake },
+	{ S::Running,	Event::Reset,		nullptr,		S::Stopped,		OnReset },
+	{ S::Running,	Event::Reverse,		nullptr,		S::Reversing,	OnReverse },
+
+	{ S::Stopping,	Event::Start,		TurningOldWay,	S::Reversing,	OnReverseCoasting },
+	{ S::Stopping,	Event::Start,		nullptr,		S::Running,		OnRepower },
+	{ S::Stopping,	Event::Recover,		RecoveringOldWay,	S::Reversing,	OnReverseCoasting },
+	{ S::Stopping,	Event::Recover,		Recovering,		S::Running,		OnRecatch },
+	{ S::Stopping,	Event::Halted,		nullptr,		S::Stopped,		OnHalted },
+	{ S::Stopping,	Event::GiveUp,		nullptr,		S::Stopped,		nullptr },
+	{ S::Stopping,	Event::FreeRun,		nullptr,		S::Stopping,	OnFreeRun },
+	{ S::Stopping,	Event::Brake,		nullptr,		S::Stopped,		OnBrake },
+	{ S::Stopping,	Event::Reset,		nullptr,		S::Stopped,		OnReset },
+	{ S::Stopping,	Event::Reverse,		nullptr,		S::Reversing,	OnReverse },
+
+	{ S::Reversing,	Event::Probe,		TurningNewWay,	S::Running,		OnRecatchReversed },
+	{ S::Reversing,	Event::Probe,		TooFastToShort,	S::Reversing,	OnCoastSlice },
+	{ S::Reversing,	Event::Probe,		StillTurning,	S::Reversing,	OnBrakeSlice },
+	{ S::Reversing,	Event::Probe,		nullptr,		S::Starting,	OnReverseStart },
+	{ S::Reversing,	Event::BrakeEnd,	nullptr,		S::Reversing,	OnBrakeEnd },
+	{ S::Reversing,	Event::Reverse,		nullptr,		S::Reversing,	OnSetDirection },
+	{ S::Reversing,	Event::FreeRun,		nullptr,		S::Stopping,	OnFreeRun },
+	{ S::Reversing,	Event::Brake,		nullptr,		S::Stopped,		OnBrake },
+	{ S::Reversing,	Event::Reset,		nullptr,		S::Stopped,		OnReset },
+
+	{ S::Braking,	Event::Crossing,	nullptr,		S::Braking,		OnBrakeCrossing },
+	{ S::Braking,	Event::Commutate,	BrakeDone,		S::Stopped,		OnBrakeFinish },
+	{ S::Braking,	Event::Commutate,	nullptr,		S::Braking,		OnCommutate },
+	{ S::Braking,	Event::Flywheel,	Desynced,		S::Stopped,		OnBrakeFinish },
+	{ S::Braking,	Event::Flywheel,	nullptr,		S::Braking,		OnFlywheel },
+	{ S::Braking,	Event::Stall,		nullptr,		S::Stopped,		OnBrakeFinish },
+	{ S::Braking,	Event::Start,		nullptr,		S::Running,		OnBrakeCancel },
+	{ S::Braking,	Event::FreeRun,		nullptr,		S::Stopping,	OnFreeRun },
+	{ S::Braking,	Event::Brake,		nullptr,		S::Stopped,		OnBrake },
+	{ S::Braking,	Event::Reset,		nullptr,		S::Stopped,		OnReset },
+	{ S::Braking,	Event::Reverse,		nullptr,		S::Reversing,	OnReverse },
+};
+
+static Machine machine(Transitions, sizeof(Transitions) / sizeof(Transitions[0]),
+		Driver::State::Stopped, Timer::Micros);
+
+static void Post(Event e, uint32_t arg0, uint32_t arg1) {
+	machine.Post(e, arg0, arg1);
+}
+
+static Driver::State State() {
+	return machine.Current();
+}
+
+HAL::BLDC::Driver::Driver() {
+	Post(Event::Reset);
+	ApplyConfiguration();
+}
+
+bool HAL::BLDC::Driver::ApplyConfiguration() {
+	if (machine.Current() != State::Stopped) {
+		return false;
+	}
+	const Config::Parameters &c = Config::Active;
+	const uint16_t steps = StartRamp::Generate(c.start, startPeriod, startPWM);
+	if (!steps) {
+		LOG_UART(Log::Lvl::Err, "Invalid start ramp configuration");
+		return false;
+	}
+	startLength = steps;
+	SetTorqueGains(c.torqueKp, c.torqueKi);
+	SetCurrentLimit(c.currentLimit);
+	SetBraking(c.brakeCurrent, c.maxBusVoltage);
+	Detector::SetBlanking(c.blanking);
+	Detector::SetSamplingOffset(c.samplingOffset);
+	InductanceSensing::SetCalibration(c.calibration);
+	return SetAdvanceCurve(c.advance, c.advancePoints);
+}
+
+static void UpdateADCCallback();
+
 void HAL::BLDC::Driver::SetPWM(int16_t promille) {
-	LowLevel::SetPWM(promille);
+	SetDuty(DutyFromPromille((int32_t) promille << 16));
+}
+
+void HAL::BLDC::Driver::SetDuty(uint16_t q15) {
+	if (machine.Current() == State::Braking) {
+		// regulated by BrakeControl()
+		return;
+	}
+	if (TorqueMode) {
+		TorqueMode = false;
+		UpdateADCCallback();
+	}
+	const uint16_t max = DutyFromPromille((int32_t) Config::Active.maxPWM << 16);
+	LowLevel::SetDuty(q15 < max ? q15 : max);
+}
+
+void HAL::BLDC::Driver::EnableDithering(bool enable) {
+	LowLevel::EnableDithering(enable);
+}
+
+bool HAL::BLDC::Driver::SetCenterAligned(bool enable) {
+	if (machine.Current() != State::Stopped) {
+		return false;
+	}
+	LowLevel::SetCenterAligned(enable);
+	return true;
+}
+
+void HAL::BLDC::Driver::EnableSynchronousSampling(bool enable) {
+	PowerADC::EnableSynchronousSampling(enable);
+}
+
+void HAL::BLDC::Driver::EnableAdaptivePWM(bool enable) {
+	CriticalSection crit;
+	adaptivePWM = enable;
+	if (!enable) {
+		SetPWMLevel(DefaultPWMLevel);
+	}
+}
+
+void HAL::BLDC::Driver::SetCurrent(int32_t mA) {
+	TorqueSetpoint = mA;
+	TorqueMode = true;
+	UpdateADCCallback();
+}
+
+static void CurrentLimit(bool exceeded) {
+	if (exceeded) {
+		LowLevel::LimitPWM();
+	} else {
+		LowLevel::RecoverPWM();
+	}
+}
+
+void HAL::BLDC::Driver::SetTorqueGains(int32_t kp, int32_t ki) {
+	CriticalSection crit;
+	torqueKp = kp;
+	torqueKiBlock = TorqueKiBlock(ki);
+}
+
+void HAL::BLDC::Driver::SetCurrentLimit(uint32_t mA) {
+	PowerADC::SetCurrentLimit(mA, CurrentLimit);
+}
+
+void HAL::BLDC::Driver::SetBraking(uint32_t mA, uint32_t maxBusmV) {
+	{
+		CriticalSection crit;
+		brakeCurrent = mA;
+		maxBusVoltage = maxBusmV;
+	}
+	UpdateADCCallback();
 }
 
 void HAL::BLDC::Driver::InitiateStart() {
-	if (state == State::Stopped) {
-		Log::Uart(Log::Lvl::Inf, "Initiating start sequence");
-		state = State::Starting;
-		uint8_t sector;
-		do {
-			sector = InductanceSensing::RotorPosition();
-		} while (!sector);
-		StartTime = 0;
-		StartSteps = 0;
-		if (sector == 0) {
-			// unable to determine rotor position, use align and go
-			LowLevel::SetPWM(30);
-			Detector::Disable();
-			SetStep(CommutationStep);
-			Timer::Schedule(1000000, NextStartStep);
-		} else {
-			SetPWM(100);
-			// rotor position determined, modify next commutation step accordingly
-			CommutationStep = (7 - sector) % 6;
-//		SetStep(CommutationStep);
-//		Detector::Enable(CrossingCallback);
-			NextStartStep();
-		}
-	} else if (state == State::Stopping){
-		state = State::Running;
-		timeBetweenCommutations = 100000;
-		Log::Uart(Log::Lvl::Inf, "Repower idling motor");
-		CommutationStep = (CommutationStep + 2) % 6;
-		LowLevel::SetPWM(StartFinalPWM);
-		SetStep(CommutationStep);
-		Detector::DisableIdleTracking();
-		Detector::Enable(CrossingCallback);
+	// starts when stopped, repowers when coasting, ignored otherwise
+	Post(Event::Start);
+}
+
+void HAL::BLDC::Driver::SetStartMode(StartMode mode) {
+	startMode = mode;
+}
+
+void HAL::BLDC::Driver::SetDirection(Direction d) {
+	if (d != direction) {
+		Post(Event::Reverse, (uint32_t) d);
 	}
 }
 
+Driver::Direction HAL::BLDC::Driver::GetDirection() {
+	return direction;
+}
+
 void HAL::BLDC::Driver::RegisterIncCallback(IncCallback c, void* ptr) {
 	IncCB = c;
 	IncPtr = ptr;
 }
 
 Driver::State HAL::BLDC::Driver::GetState() {
-	return state;
+	return machine.Current();
 }
 
-void HAL::BLDC::Driver::RegisterADCCallback(ADCCallback c, void* ptr) {
-	UNUSED(c);
+uint32_t HAL::BLDC::Driver::GetCommutationPeriod() {
+	switch (machine.Current()) {
+	case State::Running:
+	case State::Braking:
+		return timeBetweenCommutations;
+	case State::Stopping:
+	case State::Reversing:
+		return idlePeriod;
+	default:
+		return 0;
+	}
+}
+
+Driver::Statistics HAL::BLDC::Driver::GetStatistics() {
+	CriticalSection crit;
+	Statistics s = stats;
+	s.droppedEvents = machine.Dropped();
+	return s;
+}
+
+StateStatistics HAL::BLDC::Driver::GetStateStatistics(State s) {
+	return machine.GetStatistics(s);
+}
+
+void HAL::BLDC::Driver::ResetStatistics() {
+	CriticalSection crit;
+	stats = Statistics();
+	machine.ResetStatistics();
+}
+
+static void TorqueControl(int32_t current) {
+	if (State() != Driver::State::Running) {
+		// track the start sequence duty cycle for a bumpless transition
+		TorqueIntegral = DutyToPromille(LowLevel::GetDuty());
+		return;
+	}
+	const int32_t error = TorqueSetpoint - current;
+	const int32_t integral = TorqueIntegral + error * torqueKiBlock;
+	const int32_t max = (int32_t) Config::Active.maxPWM << 16;
+	int64_t output = integral + (int64_t) error * torqueKp * 65536 / 1000;
+	// conditional integration, hold the integral while the output saturates
+	bool saturated = LowLevel::PWMLimited() && error > 0;
+	if (output > max) {
+		output = max;
+		saturated |= error > 0;
+	} else if (output < 0) {
+		output = 0;
+		saturated |= error < 0;
+	}
+	if (!saturated) {
+		TorqueIntegral = integral;
+	}
+	LowLevel::SetDuty(Driver::DutyFromPromille(output));
+}
+
+/*
+ * Supply voltage in mV, seen on the phase driven high. 0 while the duty
+ * cycle ends before the sampling point.
+ */
+static uint32_t BusVoltage() {
+	const uint32_t onTime = (uint32_t) LowLevel::GetDuty()
+			* LowLevel::GetPeriod() / LowLevel::DutyOne;
+	// center aligned PWM samples in the middle of the on time
+	const uint32_t samplingPoint =
+			LowLevel::CenterAligned() ? 0 : Config::Active.samplingOffset;
+	if (onTime < samplingPoint + BusSampleMargin) {
+		return 0;
+	}
+	uint16_t max = 0;
+	for (uint8_t p = 0; p < 3; p++) {
+		const uint16_t sample = Detector::GetLastSample((Detector::Phase) p);
+		if (sample > max) {
+			max = sample;
+		}
+	}
+	return Detector::SampleTomV(max);
+}
+
+/*
+ * Below the back EMF duty cycle the winding current reverses and is fed back
+ * into the supply for the on time of each PWM period. The bus current is
+ * the winding current scaled by the duty cycle, comparing both at the same
+ * scale keeps the sign of the error correct down to zero duty cycle.
+ */
+static void BrakeControl(int32_t current) {
+	const int32_t duty = LowLevel::GetDuty();
+	const uint32_t bus = BusVoltage();
+	if (!busLimit && bus) {
+		busLimit = bus + BusMargin;
+	}
+	// above the limit return to the duty cycle without current
+	const int32_t target =
+			busLimit && bus > busLimit ?
+					0 : -(int32_t) ((int64_t) brakeCurrent * duty / LowLevel::DutyOne);
+	const int32_t error = target - current;
+	const int32_t integral = BrakeIntegral + error * torqueKiBlock;
+	const int32_t max = (int32_t) Config::Active.maxPWM << 16;
+	int64_t output = integral + (int64_t) error * torqueKp * 65536 / 1000;
+	bool saturated = false;
+	if (output > max) {
+		output = max;
+		saturated = error > 0;
+	} else if (output < 0) {
+		// both driven phases shorted, the strongest possible brake
+		output = 0;
+		saturated = error < 0;
+	}
+	if (!saturated) {
+		BrakeIntegral = integral;
+	}
+	LowLevel::SetDuty(Driver::DutyFromPromille(output));
+}
+
+static void ADCMeasurement(void *ptr, const PowerADC::Measurement &m) {
 	UNUSED(ptr);
+	if (TorqueMode) {
+		TorqueControl(m.mean);
+	}
+	if (State() == Driver::State::Braking) {
+		BrakeControl(m.mean);
+	}
+	if (State() == Driver::State::Running) {
+		Advance::Optimize(timeBetweenCommutations, m.mean);
+	}
+	if (ADCCB && ++ADCDecimationCnt >= ADCDecimation) {
+		ADCDecimationCnt = 0;
+		// no bus voltage measurement available
+		ADCCB(ADCPtr, 0, m.mean > 0 ? m.mean : 0);
+	}
+}
+
+static void UpdateADCCallback() {
+	// torque mode runs on every block, the ADC callback is decimated here
+	PowerADC::SetCallback(
+			ADCCB || TorqueMode || brakeCurrent
+					|| Advance::OptimizationEnabled() ?
+					ADCMeasurement : nullptr, nullptr, 1);
+}
+
+void HAL::BLDC::Driver::EnableAdvanceOptimization(bool enable) {
+	Advance::EnableOptimization(enable);
+	UpdateADCCallback();
+}
+
+bool HAL::BLDC::Driver::SetAdvanceCurve(const Advance::Point *points,
+		uint8_t count) {
+	if (!Advance::SetCurve(points, count)) {
+		LOG_UART(Log::Lvl::Err, "Invalid advance curve");
+		return false;
+	}
+	return true;
+}
+
+void HAL::BLDC::Driver::RegisterADCCallback(ADCCallback c, void* ptr) {
+	ADCPtr = ptr;
+	ADCCB = c;
+	UpdateADCCallback();
+}
+
+void HAL::BLDC::Driver::SetADCDecimation(uint16_t blocks) {
+	ADCDecimation = blocks ? blocks : 1;
+	ADCDecimationCnt = 0;
 }
 
 static void Idle() {
-	Log::Uart(Log::Lvl::Inf, "Idle");
+	LOG_DEFER(Log::Lvl::Inf, "Idle");
 	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
 	LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
 	LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
@@ -276,21 +1261,12 @@ static void Idle() {
 }
 
 void HAL::BLDC::Driver::FreeRunning() {
-	Timer::Abort();
-	Detector::Disable();
-	Idle();
-	state = State::Stopping;
-	Log::Uart(Log::Lvl::Inf, "Freerunning...");
-	Detector::EnableIdleTracking(IdleTrackingCB);
+	LOG_UART(Log::Lvl::Inf, "Freerunning...");
+	Post(Event::FreeRun);
 }
 
 void HAL::BLDC::Driver::Stop() {
-	Log::Uart(Log::Lvl::Inf, "Stopping motor");
-	Timer::Abort();
-	Detector::Disable();
-	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Low);
-	LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Low);
-	LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Low);
-	state = State::Stopped;
-	Timer::Schedule(500000, Idle);
+	LOG_UART(Log::Lvl::Inf, "Stopping motor");
+	// commutated brake if configured, otherwise phases shorted for 0.5s
+	Post(Event::Brake);
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "BLDCHAL.hpp"
+#include "StateMachine.hpp"
+#include "Advance.hpp"
 
 namespace HAL {
 namespace BLDC {
@@ -13,20 +15,151 @@ public:
 		Starting,
 		Running,
 		Stopping,
+		/* braking before starting in the other direction */
+		Reversing,
+		/* commutated braking after Stop(), see SetBraking() */
+		Braking,
 	};
 
+	/* Sets the duty cycle and leaves torque mode, ignored while braking */
 	void SetPWM(int16_t promille) override;
+	void SetDuty(uint16_t q15) override;
+	/*
+	 * Dithers the duty cycle over PWM periods for a resolution finer than one
+	 * timer count (1/1600 at 20kHz), see LowLevel::EnableDithering()
+	 */
+	void EnableDithering(bool enable);
+	/*
+	 * Torque mode: regulates the mean bus current to mA while running,
+	 * SetPWM() returns to duty cycle control
+	 */
+	void SetCurrent(int32_t mA);
+	/* Torque mode PI gains, duty cycle in promille per A (kp) and per As (ki) */
+	void SetTorqueGains(int32_t kp, int32_t ki);
+	/*
+	 * Cycle-by-cycle current limit, reduces the duty cycle within one PWM
+	 * period when a single current sample exceeds mA. 0 disables the limit
+	 */
+	void SetCurrentLimit(uint32_t mA);
+	/*
+	 * Optimizes the commutation advance curve (see Advance.hpp) towards
+	 * minimal current while running at constant speed
+	 */
+	void EnableAdvanceOptimization(bool enable);
+	/*
+	 * Commutation advance curve (see Advance::SetCurve), returns false for
+	 * unsorted or duplicate eRPM values and more than Advance::MaxDegrees
+	 */
+	bool SetAdvanceCurve(const Advance::Point *points, uint8_t count);
+	/*
+	 * Switches the PWM frequency with the speed at commutation boundaries:
+	 * 10kHz above 2ms per commutation step for lower switching losses, 40kHz
+	 * below 400us for more back EMF samples per step, 20kHz in between and
+	 * for starts.
+	 */
+	void EnableAdaptivePWM(bool enable);
+	/*
+	 * Center aligned PWM, the phase voltages are sampled in the middle of the
+	 * on and the off time: twice the detector sample rate at the same
+	 * switching frequency. Only while stopped, returns false otherwise.
+	 */
+	bool SetCenterAligned(bool enable);
+	/*
+	 * Samples the bus current together with every phase voltage sample, see
+	 * Detector::SetSampleCallback()
+	 */
+	void EnableSynchronousSampling(bool enable);
+
+	enum class StartMode : uint8_t {
+		/* Open loop ramp from the sensed rotor position */
+		Ramp,
+		/*
+		 * Alternates driving and sensing the rotor angle until the motor is
+		 * fast enough for the open loop ramp to take over, for starts under
+		 * load
+		 */
+		Sensed,
+	};
+	void SetStartMode(StartMode mode);
+
+	enum class Direction : uint8_t {
+		Forward,
+		Reverse,
+	};
+	/*
+	 * Applies to the next start while stopped. A running or coasting motor is
+	 * reversed: it coasts until shorted windings stay within the current limit
+	 * and is braked in slices until idle tracking no longer sees it turning,
+	 * then started the other way. A rotor already turning the new way is
+	 * re-caught instead, one coasting the old way on a start is reversed.
+	 */
+	void SetDirection(Direction d);
+	Direction GetDirection();
+
+	/*
+	 * Takes over the active configuration (see Config.hpp), start ramp, gains,
+	 * limits, calibration and advance curve. Only while stopped, the
+	 * constructor applies it. Values set individually afterwards are
+	 * overwritten.
+	 */
+	bool ApplyConfiguration();
 
 	void FreeRunning();
 	void Stop();
+	/*
+	 * Braking on Stop(). mA = 0 shorts the phases for 0.5s. Otherwise a
+	 * running motor stays commutated and the duty cycle is regulated for a
+	 * winding current of mA against the rotation, the kinetic energy flows
+	 * back into the supply. Regeneration pauses while the supply exceeds
+	 * maxBusmV, 0 limits it to the supply voltage at the start of braking.
+	 * Below the final speed of the start ramp the phases are shorted.
+	 */
+	void SetBraking(uint32_t mA, uint32_t maxBusmV);
 
 	State GetState();
+	/*
+	 * Time per commutation step in us, tracked by idle tracking while coasting.
+	 * 0 if stopped or unknown
+	 */
+	uint32_t GetCommutationPeriod();
+
+	struct Statistics {
+		/* start sequences, including automatic restarts */
+		uint32_t starts;
+		uint32_t failedStarts;
+		/* duration of the last successful start sequence in us */
+		uint32_t lastStartTime;
+		/* no crossing within the expected time */
+		uint32_t stalls;
+		/* too many consecutive steps without an accepted crossing */
+		uint32_t desyncs;
+		/* crossings rejected by the predictor */
+		uint32_t anomalies;
+		/* recovered by repowering the still turning motor */
+		uint32_t recatches;
+		/* recovered by a new start sequence */
+		uint32_t restarts;
+		uint32_t reversals;
+		/* from SetDirection() to running the other way, last reversal in us */
+		uint32_t lastReversalTime;
+		/* events lost to a full state machine queue */
+		uint32_t droppedEvents;
+	};
+	Statistics GetStatistics();
+	/* Entries and time spent per state */
+	StateStatistics GetStateStatistics(State s);
+	void ResetStatistics();
 
 
 	void InitiateStart() override;
 
 	void RegisterIncCallback(IncCallback c, void *ptr) override;
 	void RegisterADCCallback(ADCCallback c, void *ptr) override;
+	/*
+	 * Sets the ADC callback rate in current measurement blocks (125us each),
+	 * defaults to 8 (1kHz). The callback reports the mean current in mA.
+	 */
+	void SetADCDecimation(uint16_t blocks);
 
 };
 }
@@ -0,0 +1,317 @@
+#include "Identification.hpp"
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "lowlevel.hpp"
+#include "Detector.hpp"
+#include "PowerADC.hpp"
+#include "InductanceSensing.hpp"
+#include "Commutation.hpp"
+#include "Config.hpp"
+#include "Logging.hpp"
+
+using namespace HAL::BLDC;
+
+static constexpr uint32_t MinSupply = 3000;
+
+// resistance: duty ramp until the phase current reaches ResistanceCurrent,
+// measured at half and full current
+static constexpr int32_t ResistanceCurrent = 2000;
+static constexpr int16_t MaxResistancePWM = 150;
+static constexpr uint32_t RampStepTime = 20;
+static constexpr uint32_t SettleTime = 300;
+static constexpr uint8_t CurrentBlocks = 64;
+
+static constexpr uint8_t InductanceAverages = 16;
+// half of the minimum commutation period of 1ms
+static constexpr uint8_t MaxBlanking = 10;
+
+// Ke: steady state at two duty cycles, inertia: coast down from the higher one
+static constexpr int16_t KeLowPWM = 150;
+static constexpr int16_t KeHighPWM = 300;
+static constexpr uint32_t StartTimeout = 5000;
+// coast down until idle tracking no longer sees the rotor turning
+static constexpr uint32_t StopTimeout = 30000;
+static constexpr uint32_t SpeedSettleTime = 1000;
+static constexpr uint8_t SpeedSamples = 100;
+static constexpr uint32_t CoastSampleTime = 5;
+static constexpr uint8_t CoastSamples = 20;
+
+// derived settings
+static constexpr int32_t StartCurrent = 4000;
+// open loop acceleration in percent of the possible one
+static constexpr uint32_t AccelerationMargin = 50;
+static constexpr uint32_t MinStartLength = 20000;
+// torque controller bandwidth in rad/s, a decade below the block rate
+static constexpr uint32_t CurrentBandwidth = 2400;
+// (60 / 2pi)² * 1000, converts between eRPM and rad/s twice, the uses divide
+// the 1000 out again
+static constexpr uint64_t RadToRPMSquared = 91189;
+
+static Identification::Result last;
+
+/* Mean phase current in mA, derived from the bus current at the given duty */
+static int32_t PhaseCurrent(int16_t duty) {
+	int32_t sum = 0;
+	for (uint8_t i = 0; i < CurrentBlocks; i++) {
+		sum += PowerADC::GetMeasurement().mean;
+		vTaskDelay(1);
+	}
+	return sum / CurrentBlocks * 1000 / duty;
+}
+
+static void Release() {
+	LowLevel::SetPWM(0);
+	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
+	LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
+	LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
+}
+
+static bool MeasureSupply(Identification::Result &r) {
+	// the voltage of a constantly high phase is the supply voltage
+	Release();
+	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::ConstLow);
+	vTaskDelay(2);
+	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::ConstHigh);
+	vTaskDelay(2);
+	const uint16_t sample = Detector::GetLastSample(Detector::Phase::A);
+	Release();
+	r.supply = Detector::SampleTomV(sample);
+	return r.supply >= MinSupply;
+}
+
+static bool MeasureResistance(Identification::Result &r) {
+	int16_t lowDuty = 0;
+	int32_t lowCurrent = 0;
+	Commutation::SetStep(0);
+	for (int16_t duty = 1; duty <= MaxResistancePWM; duty++) {
+		LowLevel::SetPWM(duty);
+		vTaskDelay(RampStepTime);
+		int32_t current = PhaseCurrent(duty);
+		if (!lowDuty && current >= ResistanceCurrent / 2) {
+			// the rotor aligns with the field first
+			vTaskDelay(SettleTime);
+			lowDuty = duty;
+			lowCurrent = PhaseCurrent(duty);
+		} else if (lowDuty && duty > lowDuty && current >= ResistanceCurrent) {
+			vTaskDelay(SettleTime);
+			current = PhaseCurrent(duty);
+			Release();
+			if (current <= lowCurrent) {
+				return false;
+			}
+			// the slope cancels voltage drops of the switches and dead time
+			r.resistance = r.supply * (duty - lowDuty) / (current - lowCurrent);
+			return true;
+		}
+	}
+	Release();
+	return false;
+}
+
+static bool MeasureInductance(Identification::Result &r) {
+	InductanceSensing::RotorPosition(InductanceAverages);
+	const int32_t current = InductanceSensing::PulseCurrent();
+	if (current <= 0) {
+		return false;
+	}
+	// i = V/R * (1 - exp(-t R/L)), first order: L = V t / i - R t / 2
+	constexpr uint32_t t = InductanceSensing::PulseLength;
+	const int32_t inductance = r.supply * t / current
+			- r.resistance * t / 2 / 1000;
+	if (inductance <= 0) {
+		return false;
+	}
+	r.inductance = inductance;
+	return true;
+}
+
+static bool WaitForState(Driver &d, Driver::State s, uint32_t timeout) {
+	for (uint32_t t = 0; t < timeout; t += 10) {
+		if (d.GetState() == s) {
+			return true;
+		}
+		vTaskDelay(10);
+	}
+	return false;
+}
+
+struct OperatingPoint {
+	uint32_t eRPM;
+	// back EMF in mV and phase current in mA
+	int32_t emf;
+	int32_t current;
+};
+
+static bool MeasureOperatingPoint(Driver &d, const Identification::Result &r,
+		int16_t duty, OperatingPoint &p) {
+	d.SetPWM(duty);
+	vTaskDelay(SpeedSettleTime);
+	uint64_t period = 0;
+	for (uint8_t i = 0; i < SpeedSamples; i++) {
+		period += d.GetCommutationPeriod();
+		vTaskDelay(2);
+	}
+	period /= SpeedSamples;
+	if (!period || d.GetState() != Driver::State::Running) {
+		return false;
+	}
+	// six steps per electrical revolution
+	p.eRPM = 10000000UL / period;
+	p.current = PhaseCurrent(duty);
+	p.emf = (int32_t) (r.supply * duty / 1000)
+			- (int32_t) r.resistance * p.current / 1000;
+	return true;
+}
+
+static bool MeasureMechanics(Driver &d, Identification::Result &r) {
+	d.InitiateStart();
+	if (!WaitForState(d, Driver::State::Running, StartTimeout)) {
+		// stop the start sequence and its retries
+		d.FreeRunning();
+		return false;
+	}
+	OperatingPoint low, high;
+	if (!MeasureOperatingPoint(d, r, KeLowPWM, low)
+			|| !MeasureOperatingPoint(d, r, KeHighPWM, high)
+			|| high.eRPM <= low.eRPM || high.emf <= low.emf) {
+		d.FreeRunning();
+		return false;
+	}
+	r.ke = (uint32_t) (high.emf - low.emf) * 1000 / (high.eRPM - low.eRPM);
+
+	// The losses at the high operating point decelerate the coasting rotor:
+	// J = Kt * I / (dw/dt), least squares fit of the speed over time
+	d.FreeRunning();
+	int64_t n = 0, st = 0, sy = 0, sty = 0, stt = 0;
+	for (uint8_t i = 0; i < CoastSamples; i++) {
+		vTaskDelay(CoastSampleTime);
+		const uint32_t period = d.GetCommutationPeriod();
+		if (!period) {
+			continue;
+		}
+		const int64_t t = i * CoastSampleTime;
+		const int64_t y = 10000000UL / period;
+		n++;
+		st += t;
+		sy += y;
+		sty += t * y;
+		stt += t * t;
+	}
+	const int64_t denominator = n * stt - st * st;
+	if (n < 3 || !denominator) {
+		return false;
+	}
+	// eRPM per second
+	const int64_t deceleration = -(n * sty - st * sy) * 1000 / denominator;
+	if (deceleration <= 0) {
+		return false;
+	}
+	r.inertia = (uint64_t) r.ke * high.current * RadToRPMSquared / 1000
+			/ deceleration;
+	return r.inertia > 0;
+}
+
+bool HAL::BLDC::Identification::Run(Driver &d, Result &r) {
+	r = Result();
+	if (d.GetState() != Driver::State::Stopped) {
+		LOG_UART(Log::Lvl::Err, "Identification needs a stopped motor");
+		return false;
+	}
+	if (!MeasureSupply(r)) {
+		LOG_UART(Log::Lvl::Err, "No supply voltage (%lumV)", r.supply);
+		return false;
+	}
+	if (!MeasureResistance(r)) {
+		LOG_UART(Log::Lvl::Err, "Resistance measurement failed");
+		return false;
+	}
+	if (!MeasureInductance(r)) {
+		LOG_UART(Log::Lvl::Err, "Inductance measurement failed");
+		return false;
+	}
+	const bool mechanics = MeasureMechanics(d, r);
+	// the driver is released to the caller only once the motor stopped
+	const bool stopped = WaitForState(d, Driver::State::Stopped, StopTimeout);
+	if (!mechanics) {
+		LOG_UART(Log::Lvl::Err, "Spin up/coast down failed");
+		return false;
+	}
+	if (!stopped) {
+		LOG_UART(Log::Lvl::Err, "Motor did not stop after coasting down");
+		return false;
+	}
+	last = r;
+	return true;
+}
+
+Identification::Result HAL::BLDC::Identification::GetLast() {
+	return last;
+}
+
+Identification::Tuning HAL::BLDC::Identification::Derive(const Result &r,
+		const StartRamp::Parameters &start) {
+	const uint8_t motorPoles = start.motorPoles;
+	Tuning t;
+	// commutation transient: the current of the released phase decays through
+	// the freewheeling diodes within L/2 * I / V
+	const uint32_t decay = r.inductance / 2 * StartCurrent / r.supply;
+	t.blanking = 2 + decay / 50;
+	if (t.blanking > MaxBlanking) {
+		t.blanking = MaxBlanking;
+	}
+
+	// pole zero cancellation of the winding time constant L / R
+	t.torqueKp = CurrentBandwidth * r.inductance / r.supply;
+	t.torqueKi = (int64_t) t.torqueKp * r.resistance * 1000 / r.inductance;
+
+	// the start current accelerates with Kt * I / J, only partially used as
+	// the open loop ramp does not apply the optimal angle
+	const uint32_t finalERPM = start.finalRPM * motorPoles / 2;
+	const uint64_t acceleration = (uint64_t) r.ke * StartCurrent
+			* RadToRPMSquared / 1000 * AccelerationMargin / 100 / r.inertia;
+	uint64_t length = acceleration ? finalERPM * 1000000ULL / acceleration : 0;
+	if (length < MinStartLength) {
+		length = MinStartLength;
+	} else if (length > UINT32_MAX) {
+		length = UINT32_MAX;
+	}
+	const uint32_t resistiveDrop = StartCurrent * r.resistance / 1000;
+	t.startMinPWM = resistiveDrop * 1000 / r.supply;
+	t.startFinalPWM = ((uint64_t) r.ke * finalERPM / 1000 + resistiveDrop)
+			* 1000 / r.supply;
+	// shorten a slow ramp to the available number of steps
+	StartRamp::Parameters ramp = start;
+	ramp.length = length;
+	ramp.minPWM = t.startMinPWM;
+	ramp.finalPWM = t.startFinalPWM;
+	while (!StartRamp::Generate(ramp, nullptr, nullptr)
+			&& ramp.length > MinStartLength) {
+		ramp.length -= ramp.length / 8;
+	}
+	t.startLength = ramp.length;
+
+	// Speed controller: feed forward of the back EMF, PI zero at the
+	// mechanical time constant R J / Kt²
+	t.speed = SpeedControl::DefaultParameters;
+	const int64_t inverseGain = (int64_t) r.ke * motorPoles / 2 * 65536
+			/ r.supply;
+	const uint64_t mechanicalTime = (uint64_t) r.resistance * r.inertia
+			* 10966 / ((uint64_t) r.ke * r.ke);
+	t.speed.Kff = inverseGain;
+	t.speed.Kp = inverseGain;
+	t.speed.Ki = mechanicalTime ? inverseGain * 1000000 / mechanicalTime : 0;
+	return t;
+}
+
+void HAL::BLDC::Identification::Update(Config::Parameters &p,
+		const Result &r, const Tuning &t) {
+	p.motor = r;
+	p.blanking = t.blanking;
+	p.torqueKp = t.torqueKp;
+	p.torqueKi = t.torqueKi;
+	p.start.length = t.startLength;
+	p.start.minPWM = t.startMinPWM;
+	p.start.finalPWM = t.startFinalPWM;
+	p.speed = t.speed;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Driver.hpp"
+#include "SpeedControl.hpp"
+#include "StartRamp.hpp"
+
+namespace HAL {
+namespace BLDC {
+
+namespace Config {
+struct Parameters;
+}
+
+namespace Identification {
+
+struct Result {
+	/* Supply voltage in mV */
+	uint32_t supply;
+	/* Phase to phase resistance in mOhm */
+	uint32_t resistance;
+	/* Phase to phase inductance in uH */
+	uint32_t inductance;
+	/* Back EMF constant, mean six-step voltage in uV per eRPM */
+	uint32_t ke;
+	/*
+	 * Rotor inertia referred to the electrical angle (J / pole pairs²) in
+	 * 1e-9 kgm². The number of poles can not be measured electrically.
+	 */
+	uint32_t inertia;
+};
+
+struct Tuning {
+	/* Detector blanking in samples (see Detector::SetBlanking) */
+	uint8_t blanking;
+	/* Torque mode gains (see Driver::SetTorqueGains) */
+	int32_t torqueKp;
+	int32_t torqueKi;
+	/* Open loop start ramp: duration in us, duty cycle at its begin and end */
+	uint32_t startLength;
+	uint16_t startMinPWM;
+	uint16_t startFinalPWM;
+	SpeedControl::Parameters speed;
+};
+
+/*
+ * Measures the motor parameters, task context only. Resistance and
+ * inductance are measured at standstill, Ke and inertia from a spin up and
+ * coast down. The motor has to be at rest and free to turn, nothing else may
+ * control the driver meanwhile. Returns with the driver stopped, false if a
+ * measurement failed, the parameters measured up to then are valid.
+ */
+bool Run(Driver &d, Result &r);
+
+/* Last successful result, all zero if none */
+Result GetLast();
+
+/*
+ * Settings for the motor, pole count, final speed and maximum period of the
+ * open loop start are taken from start
+ */
+Tuning Derive(const Result &r, const StartRamp::Parameters &start);
+
+/*
+ * Stores result and tuning in a configuration, activate it with Config::Set()
+ * and Driver::ApplyConfiguration()
+ */
+void Update(Config::Parameters &p, const Result &r, const Tuning &t);
+
+}
+}
+}
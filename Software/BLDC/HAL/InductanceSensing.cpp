@@ -5,20 +5,46 @@
 #include "PowerADC.hpp"
 #include "Detector.hpp"
 #include "Logging.hpp"
+#include "critical.hpp"
 
 using namespace HAL::BLDC;
 
 extern ADC_HandleTypeDef hadc2;
 
-static constexpr uint16_t pulseLength = 50;
 static constexpr uint8_t BaseClkMHz = 32;
 
 static constexpr uint8_t CurrentADCClockMHz = 64;
 static constexpr uint16_t CurrentADCSamplingCycles = 8;
 
-static uint8_t stepCnt;
-static volatile bool done;
+// pulse sequence followed by boot capacitor charging and idle steps
+static constexpr uint8_t SequenceSteps = 12;
+static constexpr uint8_t CycleSteps = 16;
+static constexpr uint8_t ChargeStep = SequenceSteps;
+// one current sample every second step, sample 0 at the end of ChargeStep
+static constexpr uint8_t CycleSamples = CycleSteps / 2;
+static constexpr uint8_t FirstSample = (CycleSteps - ChargeStep) / 2;
+// the first sequence is preceded by 1ms of charging, otherwise by the
+// charging steps of one cycle only
+static constexpr uint8_t ChargeCycles = 2;
 
+static uint8_t stepCnt;
+// the pulse timing needs edge aligned PWM, restored afterwards
+static bool centerAligned;
+static uint8_t chargeCycles;
+static uint8_t startChargeCycles;
+
+static uint16_t samples[CycleSamples];
+static uint32_t settings[2];
+static volatile bool active;
+static InductanceSensing::Callback callback;
+static uint8_t averages;
+static uint8_t sequences;
+static uint8_t skipSequences;
+static uint8_t retries;
+static int32_t sum[6];
+static InductanceSensing::Result best;
+
+// averaged currents of the last measurement (raw ADC values)
 uint16_t I[6];
 
 static void SetPhases(uint8_t step) {
@@ -71,19 +97,31 @@ static void SetPhases(uint8_t step) {
 		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
 		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
 		break;
+	case 12:
+		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::ConstLow);
+		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::ConstLow);
+		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::ConstLow);
+		break;
+	case 13:
+		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
+		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
+		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
+		break;
 	}
 }
 
 /*
  * Configures PWM and ADC sampling for inductance sensing
  */
-static void ConfigureHardware(uint32_t *SettingBuffer, uint16_t *CurrentBuf) {
+static void ConfigureHardware(uint32_t *SettingBuffer) {
 	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
 	LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
 	LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
 
 	PowerADC::Pause();
 	Detector::Disable();
+	centerAligned = LowLevel::CenterAligned();
+	LowLevel::SetCenterAligned(false);
 
     HAL_NVIC_SetPriority(TIM1_UP_TIM16_IRQn, 0 ,0);
     HAL_NVIC_EnableIRQ(TIM1_UP_TIM16_IRQn);
@@ -98,8 +136,8 @@ static void ConfigureHardware(uint32_t *SettingBuffer, uint16_t *CurrentBuf) {
 	TIM2->CNT = 0;
 	TIM15->CNT = 0;
 
-	// configure PWM to a cycle length of pulseLength to adjust phase voltage ADC sampling rate
-	constexpr uint16_t PWMPeriod = pulseLength * BaseClkMHz;
+	// configure PWM to a cycle length of PulseLength to adjust phase voltage ADC sampling rate
+	constexpr uint16_t PWMPeriod = InductanceSensing::PulseLength * BaseClkMHz;
 	SettingBuffer[0] = TIM1->ARR;
 	TIM1->ARR = PWMPeriod - 1;
 
@@ -113,7 +151,7 @@ static void ConfigureHardware(uint32_t *SettingBuffer, uint16_t *CurrentBuf) {
 	TIM2->EGR = TIM_EGR_UG;
 	TIM15->EGR = TIM_EGR_UG;
 
-	HAL_ADC_Start_DMA(&hadc2, (uint32_t*) CurrentBuf, 6);
+	HAL_ADC_Start_DMA(&hadc2, (uint32_t*) samples, CycleSamples);
 
 	// start sampling slightly before the next step starts
 	TIM15->CNT = PWMPeriod + CurrentADCSamplingCycles * BaseClkMHz / CurrentADCClockMHz;
@@ -123,14 +161,14 @@ static void ConfigureHardware(uint32_t *SettingBuffer, uint16_t *CurrentBuf) {
 	// enable interrupt and start timer
 	TIM1->DIER = TIM_DIER_UIE;
 
-	// charge boot capacitor as phase A will be high in the first induction sensing step
-	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::ConstLow);
-	HAL_Delay(1);
+	// charge the boot capacitors before the first pulse, timed by the step
+	// interrupt instead of blocking here
+	stepCnt = ChargeStep;
+	chargeCycles = startChargeCycles;
+	SetPhases(stepCnt);
 
 	// Start the whole process by enabling the master clock
 	TIM2->CR1 |= TIM_CR1_CEN;
-	stepCnt = 0;
-	SetPhases(stepCnt);
 }
 
 /*
@@ -138,7 +176,12 @@ static void ConfigureHardware(uint32_t *SettingBuffer, uint16_t *CurrentBuf) {
  */
 static void ReconfigureHardware(uint32_t *SettingBuffer) {
     HAL_NVIC_DisableIRQ(TIM1_UP_TIM16_IRQn);
+	TIM1->DIER &= ~TIM_DIER_UIE;
 	HAL_ADC_Stop_DMA(&hadc2);
+	// the sequence may have moved on to the charging step
+	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
+	LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
+	LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
 
 	// halt and reset all relevant timers
 	// TIM2: base clk source
@@ -162,53 +205,253 @@ static void ReconfigureHardware(uint32_t *SettingBuffer) {
 	// enable the base clock again
 	TIM2->CR1 |= TIM_CR1_CEN;
 
+	LowLevel::SetCenterAligned(centerAligned);
 	PowerADC::Resume();
 }
 
-uint16_t HAL::BLDC::InductanceSensing::RotorPosition() {
+// angle of the measurement vector relative to the sector frame: 60°
+static constexpr uint16_t SectorFrameOffset = 10923;
+// sqrt(3), Q8
+static constexpr int32_t Sqrt3 = 443;
+// CORDIC gain 1.6468 and the factor 3 of the projection, Q16
+static constexpr uint32_t InverseGain = 65536 / 3 * 1000 / 1647;
+
+static int16_t calibration[InductanceSensing::CalibrationPoints];
+
+/*
+ * CORDIC vectoring, angle of (x, y) in 1/65536 turn. The magnitude scaled by
+ * the CORDIC gain is returned in x.
+ */
+static uint16_t Atan2(int32_t y, int32_t &x) {
+	// atan(2^-i) in 1/65536 turn
+	static constexpr uint16_t Atan[] = { 8192, 4836, 2555, 1297, 651, 326, 163,
+			81, 41, 20, 10, 5, 3, 1 };
+	uint16_t angle = 0;
+	if (x < 0) {
+		x = -x;
+		y = -y;
+		angle = 32768;
+	}
+	for (uint8_t i = 0; i < sizeof(Atan) / sizeof(Atan[0]); i++) {
+		const int32_t dx = x >> i;
+		const int32_t dy = y >> i;
+		if (y > 0) {
+			x += dy;
+			y -= dx;
+			angle += Atan[i];
+		} else {
+			x -= dy;
+			y += dx;
+			angle -= Atan[i];
+		}
+	}
+	return angle;
+}
+
+static int16_t Correction(uint16_t angle) {
+	constexpr uint8_t n = InductanceSensing::CalibrationPoints;
+	const uint32_t pos = (uint32_t) angle * n;
+	const uint8_t i = pos >> 16;
+	const int32_t frac = pos & 0xFFFF;
+	const int32_t lower = calibration[i];
+	const int32_t upper = calibration[(i + 1) % n];
+	return lower + (upper - lower) * frac / 65536;
+}
+
+static InductanceSensing::Result Evaluate() {
+	for (uint8_t i = 0; i < 6; i++) {
+		I[i] = sum[i] / averages;
+	}
+	// Current difference of opposite pulses through the same phases. The pulse
+	// along the rotor flux saturates the core and draws more current, each
+	// difference is proportional to the cosine of the rotor angle relative to
+	// its phase pair (-30°, -90° and -150°). The ADC measures lower values
+	// for higher currents.
+	const int32_t x1 = sum[1] - sum[0];
+	const int32_t x2 = sum[2] - sum[3];
+	const int32_t x3 = sum[5] - sum[4];
+
+	// projection onto the stator frame, both scaled by 3
+	int32_t alpha = Sqrt3 * (x1 - x3) / 256;
+	const int32_t beta = -(x1 + 2 * x2 + x3);
+	const uint16_t theta = Atan2(beta, alpha);
+
+	InductanceSensing::Result r = { 0, 0, 0 };
+	const uint32_t amplitude = (uint64_t) alpha * InverseGain / 65536 / averages;
+	r.confidence = amplitude > UINT16_MAX ? UINT16_MAX : amplitude;
+	if (!r.confidence) {
+		return r;
+	}
+	// the sectors advance against the stator angle
+	const uint16_t raw = SectorFrameOffset - theta;
+	r.angle = raw + Correction(raw);
+	r.sector = ((uint32_t) r.angle * 6 >> 16) + 1;
+	return r;
+}
+
+void HAL::BLDC::InductanceSensing::SetCalibration(const int16_t *table) {
+	CriticalSection crit;
+	for (uint8_t i = 0; i < CalibrationPoints; i++) {
+		calibration[i] = table[i];
+	}
+}
+
+void HAL::BLDC::InductanceSensing::GetCalibration(int16_t *table) {
+	for (uint8_t i = 0; i < CalibrationPoints; i++) {
+		table[i] = calibration[i];
+	}
+}
+
+void HAL::BLDC::InductanceSensing::Calibrate(const uint16_t *measured) {
+	constexpr uint32_t step = 65536 / CalibrationPoints;
+	int16_t error[CalibrationPoints];
+	for (uint8_t i = 0; i < CalibrationPoints; i++) {
+		error[i] = (int16_t) (uint16_t) (i * step - measured[i]);
+	}
+	int16_t table[CalibrationPoints];
+	for (uint8_t j = 0; j < CalibrationPoints; j++) {
+		const uint16_t angle = j * step;
+		// find the measured interval containing the grid angle
+		uint8_t nearest = 0;
+		uint16_t nearestDistance = UINT16_MAX;
+		bool found = false;
+		for (uint8_t i = 0; i < CalibrationPoints; i++) {
+			const uint8_t next = (i + 1) % CalibrationPoints;
+			const uint16_t offset = angle - measured[i];
+			const uint16_t span = measured[next] - measured[i];
+			if (offset < span) {
+				table[j] = error[i]
+						+ (int32_t) (error[next] - error[i]) * offset / span;
+				found = true;
+				break;
+			}
+			const uint16_t distance =
+					offset < 32768 ? offset : (uint16_t) -offset;
+			if (distance < nearestDistance) {
+				nearestDistance = distance;
+				nearest = i;
+			}
+		}
+		if (!found) {
+			// measurements not monotonic, use the closest one
+			table[j] = error[nearest];
+		}
+	}
+	SetCalibration(table);
+}
+
+bool HAL::BLDC::InductanceSensing::Start(Callback cb, uint8_t avg,
+		uint8_t maxRetries, bool charge) {
+	{
+		CriticalSection crit;
+		if (active) {
+			return false;
+		}
+		active = true;
+	}
+	callback = cb;
+	averages = avg ? avg : 1;
+	retries = maxRetries;
+	sequences = 0;
+	startChargeCycles = charge ? ChargeCycles : 1;
+	skipSequences = startChargeCycles - 1;
+	for (uint8_t i = 0; i < 6; i++) {
+		sum[i] = 0;
+	}
+	best = { 0, 0, 0 };
+	ConfigureHardware(settings);
+	return true;
+}
+
+void HAL::BLDC::InductanceSensing::Abort() {
+	CriticalSection crit;
+	if (active) {
+		ReconfigureHardware(settings);
+		active = false;
+	}
+}
+
+bool HAL::BLDC::InductanceSensing::Active() {
+	return active;
+}
+
+static volatile bool done;
+static InductanceSensing::Result blockingResult;
+
+static void BlockingDone(InductanceSensing::Result r) {
+	blockingResult = r;
+	done = true;
+}
+
+InductanceSensing::Result HAL::BLDC::InductanceSensing::RotorPosition(
+		uint8_t averages) {
 	done = false;
-	uint32_t buf[2];
-//	uint16_t I[6];
-	ConfigureHardware(buf, I);
+	if (!Start(BlockingDone, averages, 0)) {
+		return {0, 0, 0};
+	}
 	while (!done) {
 
 	}
-	ReconfigureHardware(buf);
+	return blockingResult;
+}
+
+int32_t HAL::BLDC::InductanceSensing::PulseCurrent() {
+	int32_t current = 0;
+	for (uint8_t i = 0; i < 6; i++) {
+		current += PowerADC::SampleTomA(I[i]);
+	}
+	return current / 6;
+}
 
-	// compares inverted with respect to paper as ADC measures lower values for higher currents
-	bool I_II = I[0] < I[1];
-	bool III_IV = I[3] < I[2];
-	bool V_VI = I[4] < I[5];
+void HAL::BLDC::InductanceSensing::DMAComplete() {
+	if (!active) {
+		return;
+	}
+	if (skipSequences) {
+		// sampled while charging
+		skipSequences--;
+		return;
+	}
+	for (uint8_t i = 0; i < 6; i++) {
+		sum[i] += samples[FirstSample + i];
+	}
+	if (++sequences < averages) {
+		return;
+	}
 
-	uint8_t section = 0;
+	const Result r = Evaluate();
+	if (r.sector && (!best.sector || r.confidence > best.confidence)) {
+		best = r;
+	}
+	if (best.confidence < MinConfidence && retries) {
+		// the hardware keeps cycling, simply measure again
+		retries--;
+		sequences = 0;
+		for (uint8_t i = 0; i < 6; i++) {
+			sum[i] = 0;
+		}
+		return;
+	}
 
-	if(I_II && !III_IV && !V_VI) {
-		section = 1;
-	} else if(I_II && III_IV && !V_VI) {
-		section = 2;
-	} else if(I_II && III_IV && V_VI) {
-		section = 3;
-	} else if(!I_II && III_IV && V_VI) {
-		section = 4;
-	} else if(!I_II && !III_IV && V_VI) {
-		section = 5;
-	} else if(!I_II && !III_IV && !V_VI) {
-		section = 6;
+	ReconfigureHardware(settings);
+	active = false;
+	if (callback) {
+		callback(best);
 	}
-	return section;
 }
 
 extern "C" {
 void TIM1_UP_TIM16_IRQHandler() {
 	// clear interrupt flag
 	TIM1->SR &= ~TIM_SR_UIF;
-	stepCnt++;
-	if (stepCnt >= 12) {
-		// all steps done
-		// disable this interrupt
-		TIM1->DIER &= ~TIM_DIER_UIE;
-		done = true;
-	} else {
+	if (++stepCnt >= CycleSteps) {
+		stepCnt = 0;
+		if (chargeCycles && !--chargeCycles) {
+			// release all phases before the first pulse
+			SetPhases(ChargeStep + 1);
+		}
+	}
+	if (!chargeCycles) {
 		SetPhases(stepCnt);
 	}
 }
@@ -6,7 +6,58 @@ namespace HAL {
 namespace BLDC {
 namespace InductanceSensing {
 
-uint16_t RotorPosition();
+struct Result {
+	/* 60° sector 1-6 containing angle, 0 if no saliency was measured */
+	uint8_t sector;
+	/* Amplitude of the current differences in ADC counts */
+	uint16_t confidence;
+	/* Electrical rotor angle, 65536 = 360°, sector n spans [n-1, n) * 60° */
+	uint16_t angle;
+};
+
+/* Length of a single sensing pulse in us */
+static constexpr uint16_t PulseLength = 50;
+
+/* Results below this confidence are measured again */
+static constexpr uint16_t MinConfidence = 4;
+
+using Callback = void(*)(Result r);
+
+/*
+ * Starts the pulse sequence in the background. The currents of `averages`
+ * sequences are averaged, a result below MinConfidence is measured again up to
+ * `retries` times. The callback is called from the DMA interrupt with the
+ * result of highest confidence. Returns false if a measurement is running.
+ * The boot capacitors are charged for 1ms first unless the phases have just
+ * been driven with PWM (charge = false).
+ */
+bool Start(Callback cb, uint8_t averages, uint8_t retries, bool charge = true);
+
+/*
+ * Per motor calibration: correction of the measured angle at every 30° of
+ * measured angle (65536 = 360°), linear interpolation in between.
+ */
+static constexpr uint8_t CalibrationPoints = 12;
+void SetCalibration(const int16_t *table);
+void GetCalibration(int16_t *table);
+/*
+ * Calculates the calibration table from the uncorrected angles measured with
+ * the rotor aligned at i * 30° (i = 0 to CalibrationPoints - 1).
+ */
+void Calibrate(const uint16_t *measured);
+
+/* Stops a running measurement without calling the callback */
+void Abort();
+
+bool Active();
+
+/* Blocking measurement without retries, task context only */
+Result RotorPosition(uint8_t averages = 1);
+
+/* Mean current at the end of the pulses of the last measurement in mA */
+int32_t PulseCurrent();
+
+void DMAComplete();
 
 }
 }
@@ -7,9 +7,31 @@ std::array<enum Log::Lvl, (int) Log::Class::MAX> levels;
 
 #include <string.h>
 #include "fifo.hpp"
+#include "critical.hpp"
 #include "usart.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "Timer.hpp"
 
-static Fifo<uint8_t, 1024> fifo __attribute__ ((section (".ccmram")));
+static SPSCFifo<uint8_t, 1024> fifo __attribute__ ((section (".ccmram")));
+
+struct Record {
+	const char *fmt;
+	uint32_t timestamp;
+	uint32_t args[Log::DeferMaxArgs];
+	Log::Lvl lvl;
+};
+
+static SPSCFifo<Record, 16> records;
+
+static constexpr uint16_t LogTaskStack = 256;
+static constexpr uint32_t LogTaskPeriodms = 2;
+static TaskHandle_t logTask;
+
+static Log::Statistics stats;
+
+/* "[INF|4294967295]:" + message + "\n" */
+static constexpr uint16_t MaxRecordLength = 17 + 128 + 1;
 
 #define USART 				3
 
@@ -26,15 +48,13 @@ static Fifo<uint8_t, 1024> fifo __attribute__ ((section (".ccmram")));
 #define NVIC_ISR_M1(x)  	NVIC_ISR_M2(x)
 #define NVIC_ISR			NVIC_ISR_M1(USART)
 
-#define writeString(s) \
-do { const char string[] = s; write(string, string + sizeof(string) - 1); } while(0)
-
 static void init() {
 	/* USART1 interrupt Init */
 	HAL_NVIC_SetPriority(NVIC_ISR, 4, 0);
 	HAL_NVIC_EnableIRQ(NVIC_ISR);
 
 	fifo.clear();
+	records.clear();
 }
 
 __weak void LogRedirect(const char *data, uint16_t length){
@@ -42,13 +62,30 @@ __weak void LogRedirect(const char *data, uint16_t length){
 	UNUSED(length);
 }
 
-void write(const char *start, const char *end) {
-	LogRedirect(start, end - start);
-	while(start != end) {
-		fifo.enqueue(*start);
-		start++;
+/*
+ * Queues a complete record for transmission. Records are either queued
+ * completely or dropped (and counted), lines are never truncated.
+ */
+static bool write(const char *start, const char *end) {
+	const uint16_t length = end - start;
+	LogRedirect(start, length);
+	{
+		// log calls happen from tasks and interrupts, serialize the producers
+		CriticalSection crit;
+		if (fifo.getSpace() < length) {
+			stats.droppedRecords++;
+			stats.droppedBytes += length;
+			return false;
+		}
+		fifo.enqueue((const uint8_t*) start, length);
+		stats.records++;
+		const uint16_t level = fifo.getLevel();
+		if (level > stats.peakLevel) {
+			stats.peakLevel = level;
+		}
 	}
 	USART_BASE->CR1 |= USART_CR1_TXEIE;
+	return true;
 }
 
 extern "C" {
@@ -69,12 +106,59 @@ void HANDLER(void)
 }
 
 
+static constexpr char LvlNames[][4] = { "DBG", "INF", "WRN", "ERR", "CRT" };
+
+static uint16_t writePrefix(char *buffer, enum Log::Lvl lvl, uint32_t timestamp) {
+	return snprintf(buffer, MaxRecordLength, "[%s|%lu]:", LvlNames[(int) lvl],
+			timestamp);
+}
+
+/*
+ * Terminates the record in buffer (containing len characters plus whatever
+ * the formatting attempted to add) with a newline and queues it
+ */
+static void finishRecord(char *buffer, int len) {
+	if (len > MaxRecordLength - 1) {
+		len = MaxRecordLength - 1;
+	}
+	buffer[len++] = '\n';
+	write(buffer, buffer + len);
+}
+
+static void formatRecord(const Record &r) {
+	char buffer[MaxRecordLength + 1];
+	int len = writePrefix(buffer, r.lvl, r.timestamp);
+	// surplus arguments are ignored by the format string
+	len += snprintf(&buffer[len], sizeof(buffer) - len - 1, r.fmt,
+			r.args[0], r.args[1], r.args[2], r.args[3]);
+	finishRecord(buffer, len);
+}
+
+static void LogTask(void *) {
+	while(1) {
+		Record r;
+		while(records.dequeue(r)) {
+			formatRecord(r);
+		}
+		vTaskDelay(LogTaskPeriodms);
+	}
+}
+
 void Log::Init(enum Lvl lvl) {
 	for (auto i = 0; i < (int) Log::Class::MAX; i++) {
 		levels[i] = lvl;
 	}
 	fifo.clear();
 	init();
+	if(!logTask) {
+		if (xTaskCreate(LogTask, "log", LogTaskStack, nullptr,
+				tskIDLE_PRIORITY + 1, &logTask) != pdPASS) {
+			// out of heap, Deferred() formats the records itself
+			logTask = nullptr;
+			Uart(Lvl::Err, "Failed to create log task, deferred records are "
+					"formatted immediately");
+		}
+	}
 }
 
 void Log::SetLevel(enum Class cls, enum Lvl lvl) {
@@ -90,35 +174,64 @@ void Log::Out(enum Class cls, enum Lvl lvl, const char* fmt, ...) {
 
 void Log::Uart(enum Lvl lvl, const char* fmt, ...) {
 	if((int) levels[(int) Class::BLDC] <= (int) lvl) {
-		switch(lvl) {
-		case Lvl::Dbg:
-			writeString("[DBG]:");
-			break;
-		case Lvl::Inf:
-			writeString("[INF]:");
-			break;
-		case Lvl::Wrn:
-			writeString("[WRN]:");
-			break;
-		case Lvl::Err:
-			writeString("[ERR]:");
-			break;
-		case Lvl::Crt:
-			writeString("[CRT]:");
-			break;
-		}
-		char buffer[128];
+		char buffer[MaxRecordLength + 1];
+		int len = writePrefix(buffer, lvl, HAL::BLDC::Timer::Micros());
 		va_list arp;
 		va_start(arp, fmt);
-		int len = vsnprintf(buffer, sizeof(buffer), fmt, arp);
+		len += vsnprintf(&buffer[len], sizeof(buffer) - len - 1, fmt, arp);
 		va_end(arp);
 
-		write(buffer, buffer + len);
-		writeString("\n");
+		finishRecord(buffer, len);
 	}
 }
 
 void Log::WriteChar(char c) {
-	fifo.enqueue(c);
-	USART_BASE->CR1 |= USART_CR1_TXEIE;
+	write(&c, &c + 1);
+}
+
+void Log::Trace(char c) {
+#if LOG_TRACE_TIMESTAMPS
+	static constexpr char digits[] = "0123456789abcdefghijklmnopqrstuv";
+	const uint32_t us = HAL::BLDC::Timer::Micros();
+	const char marker[] = { c, digits[(us >> 15) & 0x1F], digits[(us >> 10) & 0x1F],
+			digits[(us >> 5) & 0x1F], digits[us & 0x1F] };
+	write(marker, marker + sizeof(marker));
+#else
+	WriteChar(c);
+#endif
+}
+
+void Log::Deferred(enum Lvl lvl, const char* fmt, const uint32_t* args,
+		uint8_t nargs) {
+	if((int) levels[(int) Class::BLDC] <= (int) lvl) {
+		Record r;
+		r.fmt = fmt;
+		r.lvl = lvl;
+		r.timestamp = HAL::BLDC::Timer::Micros();
+		for (uint8_t i = 0; i < DeferMaxArgs; i++) {
+			r.args[i] = i < nargs ? args[i] : 0;
+		}
+		if (!logTask) {
+			// no log task to empty the queue, format in the caller's context
+			formatRecord(r);
+			return;
+		}
+		// deferred records are produced from several interrupt levels
+		CriticalSection crit;
+		if (!records.enqueue(r)) {
+			stats.droppedDeferred++;
+		} else if (records.getLevel() > stats.peakDeferred) {
+			stats.peakDeferred = records.getLevel();
+		}
+	}
+}
+
+Log::Statistics Log::GetStatistics() {
+	CriticalSection crit;
+	return stats;
+}
+
+void Log::ResetStatistics() {
+	CriticalSection crit;
+	stats = Statistics();
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include <type_traits>
 
 namespace Log {
 
@@ -18,6 +20,24 @@ enum class Class : uint8_t {
 	MAX
 };
 
+/*
+ * Compile time minimum log level per class. Calls through the LOG_UART and
+ * LOG_DEFER macros below this level are removed completely, including the
+ * evaluation of their arguments. Levels above it are still filtered at
+ * runtime. Set e.g. with -DLOG_MIN_LEVEL_BLDC=Inf (see LOG_LEVEL in Makefile)
+ */
+#ifndef LOG_MIN_LEVEL_BLDC
+#define LOG_MIN_LEVEL_BLDC		Dbg
+#endif
+
+static constexpr Lvl MinLevel[(int) Class::MAX] = {
+	Lvl::LOG_MIN_LEVEL_BLDC,
+};
+
+constexpr bool Compiled(enum Class cls, enum Lvl lvl) {
+	return (int) MinLevel[(int) cls] <= (int) lvl;
+}
+
 void Init(enum Lvl lvl);
 void SetLevel(enum Class cls, enum Lvl lvl);
 
@@ -26,4 +46,70 @@ void Out(enum Class cls, enum Lvl lvl, const char *fmt, ...);
 void Uart(enum Lvl lvl, const char *fmt, ...);
 void WriteChar(char c);
 
+/*
+ * Emits a single character trace marker. With LOG_TRACE_TIMESTAMPS set the
+ * marker is followed by the lower 20 bits of Timer::Micros() as four base 32
+ * digits ('0'-'9', 'a'-'v'), see Tools/trace_timeline.py for decoding
+ */
+#ifndef LOG_TRACE_TIMESTAMPS
+#define LOG_TRACE_TIMESTAMPS	0
+#endif
+void Trace(char c);
+
+struct Statistics {
+	/* Records (lines or trace characters) queued for transmission */
+	uint32_t records;
+	/* Records dropped because the transmit buffer was full */
+	uint32_t droppedRecords;
+	uint32_t droppedBytes;
+	/* Deferred records dropped because the record queue was full */
+	uint32_t droppedDeferred;
+	/* Highest fill level of the transmit buffer in bytes */
+	uint16_t peakLevel;
+	/* Highest number of pending deferred records */
+	uint16_t peakDeferred;
+};
+
+Statistics GetStatistics();
+void ResetStatistics();
+
+/* Maximum number of (word sized) arguments of a deferred log record */
+static constexpr uint8_t DeferMaxArgs = 4;
+
+void Deferred(enum Lvl lvl, const char *fmt, const uint32_t *args, uint8_t nargs);
+
+template<typename T>
+inline uint32_t DeferArg(T t) {
+	static_assert(!std::is_floating_point<T>::value,
+			"Floating point arguments can not be deferred");
+	static_assert(!std::is_arithmetic<T>::value || sizeof(T) <= sizeof(uint32_t),
+			"Only word sized arguments can be deferred");
+	return (uint32_t) (uintptr_t) t;
+}
+
+/*
+ * Constant time logging for interrupt context. Only the format pointer and
+ * the arguments are captured, formatting and transmission are done later in
+ * the low priority log task (immediately if the task could not be created,
+ * see Log::Init). The format string must have static storage
+ * duration (string literal) and only word sized arguments are supported
+ * (no %f, %lld or pointers to temporary strings for %s).
+ */
+template<typename... Args>
+inline void Defer(enum Lvl lvl, const char *fmt, Args... args) {
+	static_assert(sizeof...(Args) <= DeferMaxArgs,
+			"Too many arguments for deferred log record");
+	const uint32_t words[] = { DeferArg(args)..., 0 };
+	Deferred(lvl, fmt, words, sizeof...(Args));
 }
+
+}
+
+/* the integral_constant forces compile time evaluation, even without optimization */
+#define LOG_UART(lvl, ...) \
+do { if (std::integral_constant<bool, Log::Compiled(Log::Class::BLDC, lvl)>::value) \
+	Log::Uart(lvl, __VA_ARGS__); } while(0)
+
+#define LOG_DEFER(lvl, ...) \
+do { if (std::integral_constant<bool, Log::Compiled(Log::Class::BLDC, lvl)>::value) \
+	Log::Defer(lvl, __VA_ARGS__); } while(0)
@@ -3,14 +3,62 @@
 #include "stm32f3xx_hal.h"
 
 #include "Logging.hpp"
+#include "lowlevel.hpp"
+#include <atomic>
+
+using namespace HAL::BLDC;
 
 extern ADC_HandleTypeDef hadc2;
 extern TIM_HandleTypeDef htim15;
 extern OPAMP_HandleTypeDef hopamp2;
 
 static constexpr uint16_t BufferSize = 500;
+static constexpr uint16_t BlockSize = BufferSize / 2;
+
+// 1mOhm shunt, inverting amplifier with gain 51 (R9 51k / R6 1k), 3.3V
+// reference
+static constexpr uint32_t ADCReferencemV = 3300;
+static constexpr uint32_t ShuntmOhm = 1;
+static constexpr uint32_t AmplifierGain = 51;
+// nV per count at the shunt divided by the shunt resistance
+static constexpr uint32_t uAPerCount = ADCReferencemV * 1000000UL / 4096
+		/ AmplifierGain / ShuntmOhm;
+
+static_assert(BlockSize % 2 == 0, "Blocks are processed two samples at a time");
+static_assert(BlockSize * 4095UL * 4095UL <= UINT32_MAX,
+		"Sum of squares might overflow");
+
+uint16_t buf[BufferSize] __attribute__ ((aligned (4)));
+
+static uint16_t offset;
+static bool calibrate;
+// offset tracked from the off time samples in 1/256 counts, taken over at
+// block boundaries
+static int32_t trackedOffset;
+// filter time constant 2^10 off time samples (51ms at 20kHz)
+static constexpr uint8_t OffsetFilterShift = 10;
+// the amplifier settles for 2us after switching before an off time sample
+// is taken as zero current
+static constexpr uint16_t OffsetSettleCounts = 2 * LowLevel::CountsPerUs;
 
-uint16_t buf[BufferSize];
+// double buffered measurement, the buffer indexed by sequence is valid
+static PowerADC::Measurement result[2];
+static volatile uint32_t sequence;
+
+static PowerADC::Callback callback;
+static void *callbackPtr;
+static uint16_t decimation;
+static uint16_t decimationCnt;
+
+// watchdog threshold below the offset, 0 if the current limit is disabled
+static uint16_t limitCounts;
+static PowerADC::LimitCallback limitCallback;
+static volatile uint32_t limitTrips;
+
+// injected conversions on the phase voltage trigger
+static bool synchronous;
+static volatile uint16_t centerOn;
+static volatile uint16_t centerOff;
 
 void Stop() {
 	HAL_ADC_Stop_DMA(&hadc2);
@@ -18,30 +66,280 @@ void Stop() {
 
 void PrintBuf() {
 	for(uint16_t i = 0;i<BufferSize;i++) {
-		Log::Uart(Log::Lvl::Inf, "%d", buf[i]);
+		LOG_UART(Log::Lvl::Inf, "%d", buf[i]);
 		HAL_Delay(1);
 	}
 }
 
 
+static void UpdateWatchdog();
+
 void HAL::BLDC::PowerADC::Pause() {
+	// the ADC is borrowed for other measurements, keep the limit out of it
+	__HAL_ADC_DISABLE_IT(&hadc2, ADC_IT_AWD1);
+	// stops the injected conversions as well
 	HAL_ADC_Stop_DMA(&hadc2);
 }
 
 void HAL::BLDC::PowerADC::Resume() {
 	HAL_ADC_Start_DMA(&hadc2, (uint32_t*) buf, BufferSize);
+	if (synchronous) {
+		HAL_ADCEx_InjectedStart(&hadc2);
+	}
+	UpdateWatchdog();
 }
 
 
+static void UpdateWatchdog() {
+	__HAL_ADC_DISABLE_IT(&hadc2, ADC_IT_AWD1);
+	if (!limitCounts || calibrate) {
+		// thresholds spanning the full range never trip
+		hadc2.Instance->TR1 = 4095UL << ADC_TR1_HT1_Pos;
+		return;
+	}
+	// The amplifier is inverting, the current limit is a low threshold.
+	// The thresholds may be changed while converting. A limit beyond the
+	// measurement range (about 33A) trips on the saturated amplifier instead
+	// of never.
+	const uint16_t low = offset > limitCounts ? offset - limitCounts : 1;
+	hadc2.Instance->TR1 = (4095UL << ADC_TR1_HT1_Pos) | low;
+	__HAL_ADC_CLEAR_FLAG(&hadc2, ADC_FLAG_AWD1);
+	__HAL_ADC_ENABLE_IT(&hadc2, ADC_IT_AWD1);
+}
+
 void HAL::BLDC::PowerADC::Init() {
+	calibrate = true;
 	HAL_OPAMP_Start(&hopamp2);
 	HAL_ADCEx_Calibration_Start(&hadc2, ADC_SINGLE_ENDED);
+
+	// watchdog channel can only be selected while the ADC is stopped
+	ADC_AnalogWDGConfTypeDef wdg;
+	wdg.WatchdogNumber = ADC_ANALOGWATCHDOG_1;
+	wdg.WatchdogMode = ADC_ANALOGWATCHDOG_SINGLE_REG;
+	wdg.Channel = ADC_CHANNEL_3;
+	wdg.ITMode = DISABLE;
+	wdg.HighThreshold = 4095;
+	wdg.LowThreshold = 0;
+	HAL_ADC_AnalogWDGConfig(&hadc2, &wdg);
+
+	// the current channel once more as injected conversion on TIM1 TRGO2, the
+	// trigger of the phase voltages. It interrupts the regular sequence only
+	// when synchronous sampling is enabled.
+	ADC_InjectionConfTypeDef inj = { };
+	inj.InjectedChannel = ADC_CHANNEL_3;
+	inj.InjectedRank = ADC_INJECTED_RANK_1;
+	inj.InjectedSingleDiff = ADC_SINGLE_ENDED;
+	inj.InjectedSamplingTime = ADC_SAMPLETIME_7CYCLES_5;
+	inj.InjectedOffsetNumber = ADC_OFFSET_NONE;
+	inj.InjectedOffset = 0;
+	inj.InjectedNbrOfConversion = 1;
+	inj.InjectedDiscontinuousConvMode = DISABLE;
+	inj.AutoInjectedConv = DISABLE;
+	inj.QueueInjectedContext = DISABLE;
+	inj.ExternalTrigInjecConv = ADC_EXTERNALTRIGINJECCONV_T1_TRGO2;
+	inj.ExternalTrigInjecConvEdge = ADC_EXTERNALTRIGINJECCONV_EDGE_RISING;
+	HAL_ADCEx_InjectedConfigChannel(&hadc2, &inj);
+
 	HAL_ADC_Start_DMA(&hadc2, (uint32_t*) buf, BufferSize);
 	HAL_TIM_Base_Start(&htim15);
 }
 
+static uint32_t isqrt(uint32_t x) {
+	uint32_t root = 0;
+	uint32_t bit = 1UL << 30;
+	while (bit > x) {
+		bit >>= 2;
+	}
+	while (bit) {
+		if (x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+static int32_t TomA(int32_t counts) {
+	return counts * (int32_t) uAPerCount / 1000;
+}
+
+static void Process(const uint16_t *data) {
+	if (calibrate) {
+		uint32_t sum = 0;
+		for (uint16_t i = 0; i < BlockSize; i++) {
+			sum += data[i];
+		}
+		offset = sum / BlockSize;
+		trackedOffset = (int32_t) offset << 8;
+		calibrate = false;
+		UpdateWatchdog();
+		return;
+	}
+
+	const uint16_t tracked = (trackedOffset + 128) >> 8;
+	if (tracked != offset) {
+		offset = tracked;
+		UpdateWatchdog();
+	}
+
+	// The amplifier is inverting: current = offset - sample. Two samples are
+	// processed per iteration with the Cortex-M4 SIMD instructions.
+	const uint32_t offset2 = offset | ((uint32_t) offset << 16);
+	const uint32_t *samples = (const uint32_t*) data;
+	uint32_t sum = 0;
+	uint32_t sumSquares = 0;
+	uint32_t peak2 = 0x80008000;
+	for (uint16_t i = 0; i < BlockSize / 2; i++) {
+		const uint32_t current = __SSUB16(offset2, samples[i]);
+		sum = __SMLAD(current, 0x00010001, sum);
+		sumSquares = __SMLAD(current, current, sumSquares);
+		// sets the GE flags for each halfword where current >= peak
+		__SSUB16(current, peak2);
+		peak2 = __SEL(current, peak2);
+	}
+	int16_t peak = (int16_t) (peak2 & 0xFFFF);
+	if ((int16_t) (peak2 >> 16) > peak) {
+		peak = (int16_t) (peak2 >> 16);
+	}
+
+	const uint32_t next = sequence + 1;
+	PowerADC::Measurement &m = result[next & 0x01];
+	m.mean = TomA((int32_t) sum / (int32_t) BlockSize);
+	m.peak = TomA(peak);
+	m.rms = TomA(isqrt(sumSquares / BlockSize));
+	m.sequence = next;
+	std::atomic_signal_fence(std::memory_order_release);
+	sequence = next;
+
+	if (limitCounts && limitCallback) {
+		if (peak < (int16_t) limitCounts) {
+			limitCallback(false);
+		}
+		// rearm the watchdog, masked by the last trip
+		__HAL_ADC_CLEAR_FLAG(&hadc2, ADC_FLAG_AWD1);
+		__HAL_ADC_ENABLE_IT(&hadc2, ADC_IT_AWD1);
+	}
+
+	if (callback && ++decimationCnt >= decimation) {
+		decimationCnt = 0;
+		callback(callbackPtr, m);
+	}
+}
+
+void HAL::BLDC::PowerADC::Calibrate() {
+	calibrate = true;
+	UpdateWatchdog();
+}
+
+int32_t HAL::BLDC::PowerADC::SampleTomA(uint16_t sample) {
+	return TomA((int32_t) offset - sample);
+}
+
+PowerADC::Measurement HAL::BLDC::PowerADC::GetMeasurement() {
+	Measurement m;
+	uint32_t seq;
+	do {
+		// retry if a new block was published while copying (reader preempted)
+		seq = sequence;
+		std::atomic_signal_fence(std::memory_order_acquire);
+		m = result[seq & 0x01];
+		std::atomic_signal_fence(std::memory_order_acquire);
+	} while (seq != sequence);
+	return m;
+}
+
+void HAL::BLDC::PowerADC::SetCallback(Callback cb, void* ptr,
+		uint16_t blocks) {
+	callback = nullptr;
+	callbackPtr = ptr;
+	decimation = blocks ? blocks : 1;
+	decimationCnt = 0;
+	callback = cb;
+}
+
+void HAL::BLDC::PowerADC::SetCurrentLimit(uint32_t mA, LimitCallback cb) {
+	uint32_t counts = mA * 1000 / uAPerCount;
+	if (mA && !counts) {
+		counts = 1;
+	} else if (counts > 4095) {
+		counts = 4095;
+	}
+	__HAL_ADC_DISABLE_IT(&hadc2, ADC_IT_AWD1);
+	limitCallback = cb;
+	limitCounts = cb ? counts : 0;
+	UpdateWatchdog();
+}
+
+uint32_t HAL::BLDC::PowerADC::GetLimitTrips() {
+	return limitTrips;
+}
+
+void HAL::BLDC::PowerADC::WatchdogTripped() {
+	// masked until the end of the current block, the flag is cleared by HAL
+	__HAL_ADC_DISABLE_IT(&hadc2, ADC_IT_AWD1);
+	limitTrips++;
+	if (limitCallback) {
+		limitCallback(true);
+	}
+}
+
+void HAL::BLDC::PowerADC::EnableSynchronousSampling(bool enable) {
+	if (enable == synchronous) {
+		return;
+	}
+	synchronous = enable;
+	// no interrupt, the result is read with the phase voltages
+	if (enable) {
+		HAL_ADCEx_InjectedStart(&hadc2);
+	} else {
+		HAL_ADCEx_InjectedStop(&hadc2);
+	}
+}
+
+bool HAL::BLDC::PowerADC::SynchronousSampling() {
+	return synchronous;
+}
+
+PowerADC::CenterCurrent HAL::BLDC::PowerADC::GetCenterCurrent() {
+	CenterCurrent c;
+	c.on = SampleTomA(centerOn);
+	c.off = SampleTomA(centerOff);
+	return c;
+}
+
+static void TrackOffset(uint16_t sample) {
+	// the off time sample is centered, half of it has passed before
+	const uint32_t off = (uint32_t) (LowLevel::DutyOne - LowLevel::GetDuty())
+			* LowLevel::GetPeriod() / LowLevel::DutyOne;
+	if (calibrate || off < 2 * OffsetSettleCounts) {
+		return;
+	}
+	trackedOffset += (((int32_t) sample << 8) - trackedOffset)
+			>> OffsetFilterShift;
+}
+
+int32_t HAL::BLDC::PowerADC::SynchronousSample(bool onTime) {
+	if (!synchronous) {
+		return 0;
+	}
+	// 7.5 cycles, done long before the three phase voltages
+	const uint16_t sample = hadc2.Instance->JDR1;
+	if (onTime) {
+		centerOn = sample;
+	} else {
+		centerOff = sample;
+		TrackOffset(sample);
+	}
+	return SampleTomA(sample);
+}
+
 void HAL::BLDC::PowerADC::DMAComplete() {
+	Process(&buf[BlockSize]);
 }
 
 void HAL::BLDC::PowerADC::DMAHalfComplete() {
+	Process(&buf[0]);
 }
@@ -1,15 +1,90 @@
 #pragma once
 
+#include <cstdint>
+
 namespace HAL {
 namespace BLDC {
 namespace PowerADC {
 
+/* Bus current statistics over one half of the DMA buffer (250 samples, 125us) */
+struct Measurement {
+	int32_t mean;		// mA
+	int32_t peak;		// mA
+	uint32_t rms;		// mA
+	uint32_t sequence;	// increments with every processed block
+};
+
+using Callback = void (*)(void *ptr, const Measurement &m);
+
 void Init();
 void Pause();
 void Resume();
 
+/*
+ * Uses the mean of the next block as zero current offset. The bridge has
+ * to be idle while calibrating. With center aligned PWM and synchronous
+ * sampling the offset follows the off time samples afterwards, see
+ * GetCenterCurrent().
+ */
+void Calibrate();
+
+/* Converts a single raw sample to mA using the calibrated offset */
+int32_t SampleTomA(uint16_t sample);
+
+/* Lock-free read of the most recent block, usable from any context */
+Measurement GetMeasurement();
+
+/*
+ * Calls cb (in DMA interrupt context) for every decimation-th block.
+ * Passing nullptr removes the callback
+ */
+void SetCallback(Callback cb, void *ptr, uint16_t decimation);
+
+/*
+ * Synchronous sampling: an injected conversion samples the bus current on the
+ * trigger of the phase voltages (TIM1 TRGO2), the Detector reads it in the
+ * same DMA interrupt (see Detector::SetSampleCallback()). The regular stream
+ * continues, it loses one conversion slot per PWM period.
+ */
+void EnableSynchronousSampling(bool enable);
+bool SynchronousSampling();
+/*
+ * Reads the injected sample of the current phase voltage sample in mA, 0
+ * without synchronous sampling. Called by the Detector.
+ */
+int32_t SynchronousSample(bool onTime);
+
+/*
+ * Last synchronous samples in the on and off time. With center aligned PWM
+ * (see LowLevel::SetCenterAligned()) they are taken in the middle of both:
+ * in the on time it is the winding current without ripple, in the off time
+ * the current circulates through the low side switches and the shunt only
+ * sees the offset drift. Off times of at least 4us track the offset for the
+ * low load accuracy, the new offset applies from the next block on.
+ */
+struct CenterCurrent {
+	int32_t on;		// mA
+	int32_t off;	// mA
+};
+CenterCurrent GetCenterCurrent();
+
+using LimitCallback = void (*)(bool exceeded);
+
+/*
+ * Cycle-by-cycle current limit using the analog watchdog of ADC2. cb(true)
+ * is called from the watchdog interrupt as soon as a single sample exceeds
+ * the limit (at most once per block), cb(false) for every block that stayed
+ * below it. The watchdog is armed once the offset is calibrated, passing
+ * mA = 0 disables the limit. The amplifier saturates at about 33A, higher
+ * limits trip there.
+ */
+void SetCurrentLimit(uint32_t mA, LimitCallback cb);
+/* Number of watchdog trips since Init */
+uint32_t GetLimitTrips();
+
 void DMAComplete();
 void DMAHalfComplete();
+void WatchdogTripped();
 
 }
 }
@@ -0,0 +1,90 @@
+#include "Predictor.hpp"
+
+using namespace HAL::BLDC;
+
+// Tracker gains in Q8, slightly underdamped (critical: beta = alpha^2 / (2 - alpha))
+static constexpr int32_t Alpha = 32;
+static constexpr int32_t Beta = 3;
+// accepted deviation from the predicted crossing, fraction of a period but at
+// least two detector samples
+static constexpr uint8_t GateDivisor = 8;
+static constexpr int32_t MinGate = 100;
+static constexpr uint32_t MinPeriod = 20 << 8;
+
+// filtered time of the last crossing
+static uint32_t crossing;
+// commutation period in us, Q8
+static uint32_t period;
+// crossings since Reset(), saturating
+static uint8_t acquired;
+static uint32_t rejected;
+
+// The period from the first two crossings carries the full sample quantization
+// of the detector. Until the tracker gains are reached the gains of a least
+// squares line fit through the n crossings so far are used.
+static int32_t FitAlpha(uint32_t n) {
+	return 512 * (2 * n - 1) / (n * (n + 1));
+}
+
+static int32_t FitBeta(uint32_t n) {
+	return 1536 / (n * (n + 1));
+}
+
+void HAL::BLDC::Predictor::Reset(uint32_t p) {
+	period = p << 8;
+	acquired = 0;
+}
+
+bool HAL::BLDC::Predictor::Update(uint32_t crossingTime, uint32_t interval) {
+	if (acquired == 0) {
+		crossing = crossingTime;
+		if (!period) {
+			period = interval << 8;
+		}
+		acquired++;
+		return true;
+	} else if (acquired == 1) {
+		period = (crossingTime - crossing) << 8;
+		crossing = crossingTime;
+		acquired++;
+		return true;
+	}
+
+	const uint32_t predicted = crossing + (period >> 8);
+	const int32_t residual = (int32_t) (crossingTime - predicted);
+	int32_t gate = (period >> 8) / GateDivisor;
+	if (gate < MinGate) {
+		gate = MinGate;
+	}
+	if (residual > gate || residual < -gate) {
+		rejected++;
+		return false;
+	}
+	if (acquired < UINT8_MAX) {
+		acquired++;
+	}
+	const int32_t fitAlpha = FitAlpha(acquired);
+	const int32_t fitBeta = FitBeta(acquired);
+	const int32_t alpha = fitAlpha > Alpha ? fitAlpha : Alpha;
+	const int32_t beta = fitBeta > Beta ? fitBeta : Beta;
+	crossing = predicted + residual * alpha / 256;
+	const int32_t p = (int32_t) period + residual * beta;
+	period = p > (int32_t) MinPeriod ? p : MinPeriod;
+	return true;
+}
+
+void HAL::BLDC::Predictor::Coast() {
+	crossing += period >> 8;
+}
+
+uint32_t HAL::BLDC::Predictor::Period() {
+	return period >> 8;
+}
+
+int32_t HAL::BLDC::Predictor::SinceCrossing(uint32_t now) {
+	return (int32_t) (now - crossing);
+}
+
+uint32_t HAL::BLDC::Predictor::GetRejected() {
+	return rejected;
+}
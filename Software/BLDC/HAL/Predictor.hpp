@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+namespace HAL {
+namespace BLDC {
+namespace Predictor {
+
+/*
+ * Alpha-beta tracker on the zero crossing time and the commutation period,
+ * converging with the gains of a least squares fit after Reset().
+ * Measured crossings further than an eighth of a period (at least 100us) away
+ * from the prediction are rejected and leave the estimate unchanged.
+ */
+
+/* Starts a new acquisition, period 0 if unknown */
+void Reset(uint32_t period);
+
+/*
+ * Updates the estimate with a measured crossing (Timer::Micros() based),
+ * interval is the raw crossing interval from the detector. The first two
+ * crossings after Reset() are accepted unconditionally.
+ * Returns false if the crossing was rejected.
+ */
+bool Update(uint32_t crossingTime, uint32_t interval);
+
+/* Advances the estimate by one period without a measurement */
+void Coast();
+
+/* Filtered commutation period in us */
+uint32_t Period();
+
+/* Time since the filtered crossing, negative if it is still ahead */
+int32_t SinceCrossing(uint32_t now);
+
+uint32_t GetRejected();
+
+}
+}
+}
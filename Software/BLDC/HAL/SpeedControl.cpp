@@ -0,0 +1,117 @@
+#include "SpeedControl.hpp"
+
+#include "critical.hpp"
+
+using namespace HAL::BLDC;
+
+constexpr SpeedControl::Parameters SpeedControl::DefaultParameters;
+
+// converts microseconds to seconds in Q30 (2^30 / 10^6)
+static constexpr int64_t usToQ30 = 1074;
+
+HAL::BLDC::SpeedControl::SpeedControl(HALDriver& driver, uint8_t motorPoles,
+		const Parameters& param) :
+		driver(driver), param(param), setpoint(0), rpm(0), intervals(),
+		intervalSum(0), intervalPos(0), intervalCnt(0), integral(0),
+		output(0), enabled(false) {
+	// 6 commutations per electrical revolution, MotorPoles / 2 electrical
+	// revolutions per mechanical revolution:
+	// RPM = 60s / (intervalSum * motorPoles / 2)
+	rpmDividend = 120000000UL / motorPoles;
+}
+
+void HAL::BLDC::SpeedControl::SetParameters(const Parameters& param) {
+	CriticalSection crit;
+	this->param = param;
+}
+
+void HAL::BLDC::SpeedControl::SetRPM(uint16_t rpm) {
+	setpoint = rpm;
+}
+
+void HAL::BLDC::SpeedControl::Enable(int16_t currentPromille) {
+	CriticalSection crit;
+	output = (int32_t) currentPromille << 16;
+	// the feed forward part is not contained in the integrator
+	integral = output - param.Kff * (int32_t) setpoint;
+	// the moving sum subtracts the oldest interval, none of the last run
+	for (auto &i : intervals) {
+		i = 0;
+	}
+	intervalSum = 0;
+	intervalPos = 0;
+	intervalCnt = 0;
+	enabled = true;
+	driver.RegisterIncCallback(IncCallback, this);
+}
+
+void HAL::BLDC::SpeedControl::Disable() {
+	driver.RegisterIncCallback(nullptr, nullptr);
+	enabled = false;
+}
+
+uint16_t HAL::BLDC::SpeedControl::GetRPM() {
+	return rpm;
+}
+
+void HAL::BLDC::SpeedControl::IncCallback(void* ptr, uint32_t usSinceLast) {
+	static_cast<SpeedControl*>(ptr)->Update(usSinceLast);
+}
+
+void HAL::BLDC::SpeedControl::Update(uint32_t usSinceLast) {
+	if (!enabled || usSinceLast == 0) {
+		return;
+	}
+	// moving sum over the last electrical revolution, this cancels the
+	// asymmetry between the six commutation steps
+	intervalSum += usSinceLast - intervals[intervalPos];
+	intervals[intervalPos] = usSinceLast;
+	intervalPos = (intervalPos + 1) % IntervalCount;
+	if (intervalCnt < IntervalCount) {
+		intervalCnt++;
+		rpm = rpmDividend * intervalCnt / IntervalCount / intervalSum;
+	} else {
+		rpm = rpmDividend / intervalSum;
+	}
+
+	const int32_t error = (int32_t) setpoint - rpm;
+	const int64_t dtQ30 = usSinceLast * usToQ30;
+
+	const int32_t feedForward = param.Kff * (int32_t) setpoint;
+	const int32_t proportional = param.Kp * error;
+	const int32_t minQ16 = (int32_t) param.minDuty << 16;
+	const int32_t maxQ16 = (int32_t) param.maxDuty << 16;
+
+	// conditional integration: stop integrating while the output is
+	// saturated in the direction of the error (anti-windup)
+	const bool saturatedHigh = output >= maxQ16 && error > 0;
+	const bool saturatedLow = output <= minQ16 && error < 0;
+	if (!saturatedHigh && !saturatedLow) {
+		integral += ((int64_t) param.Ki * error * dtQ30) >> 30;
+		if (integral > maxQ16) {
+			integral = maxQ16;
+		} else if (integral < -maxQ16) {
+			integral = -maxQ16;
+		}
+	}
+
+	int32_t target = feedForward + proportional + integral;
+	if (target > maxQ16) {
+		target = maxQ16;
+	} else if (target < minQ16) {
+		target = minQ16;
+	}
+
+	// limit rate of change, scaled with the time since the last update
+	const int32_t maxStep = ((int64_t) param.maxSlew * dtQ30) >> 14;
+	if (target > output + maxStep) {
+		output += maxStep;
+	} else if (target < output - maxStep) {
+		output -= maxStep;
+	} else {
+		output = target;
+	}
+
+	// the fraction of a promille is kept, see HALDriver::SetDuty()
+	driver.SetDuty(HALDriver::DutyFromPromille(output));
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "BLDCHAL.hpp"
+
+namespace HAL {
+namespace BLDC {
+
+/*
+ * Closed loop speed controller on top of a HALDriver. The crossing intervals
+ * reported through the IncCallback are used to update the duty cycle once per
+ * commutation (fixed point PI controller with optional feed forward,
+ * anti-windup and duty rate limiting).
+ */
+class SpeedControl {
+public:
+	struct Parameters {
+		/* Proportional gain, promille duty per RPM error (Q16) */
+		int32_t Kp;
+		/* Integral gain, promille duty per RPM error and second (Q16) */
+		int32_t Ki;
+		/* Feed forward, promille duty per RPM setpoint (Q16), 0 to disable */
+		int32_t Kff;
+		/* Output limits in promille */
+		int16_t minDuty;
+		int16_t maxDuty;
+		/* Maximum duty change in promille per second */
+		uint32_t maxSlew;
+	};
+
+	static constexpr Parameters DefaultParameters = {
+		3277,		// Kp: 0.05 promille per RPM
+		32768,		// Ki: 0.5 promille per RPM and second
+		0,			// no feed forward
+		50,			// minDuty
+		1000,		// maxDuty
+		2000,		// maxSlew: full scale in 0.5s
+	};
+
+	SpeedControl(HALDriver &driver, uint8_t motorPoles,
+			const Parameters &param = DefaultParameters);
+
+	void SetParameters(const Parameters &param);
+	void SetRPM(uint16_t rpm);
+
+	/*
+	 * Takes over control of the driver, starting from the given duty cycle
+	 * (should be the currently applied duty for a bumpless transfer)
+	 */
+	void Enable(int16_t currentPromille);
+	void Disable();
+
+	/* Mechanical speed averaged over the last electrical revolution */
+	uint16_t GetRPM();
+
+private:
+	static void IncCallback(void *ptr, uint32_t usSinceLast);
+	void Update(uint32_t usSinceLast);
+
+	static constexpr uint8_t IntervalCount = 6;
+
+	HALDriver &driver;
+	Parameters param;
+	/* RPM * commutation interval sum over one electrical revolution */
+	uint32_t rpmDividend;
+	volatile uint16_t setpoint;
+	volatile uint16_t rpm;
+	uint32_t intervals[IntervalCount];
+	uint32_t intervalSum;
+	uint8_t intervalPos;
+	uint8_t intervalCnt;
+	/* integrator and output in promille (Q16) */
+	int32_t integral;
+	int32_t output;
+	bool enabled;
+};
+
+}
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+
+namespace HAL {
+namespace BLDC {
+namespace StartRamp {
+
+/*
+ * Open loop start ramp, generated from the runtime configuration. Both shapes
+ * reach the final speed at the end of the ramp:
+ * ConstantAcceleration: speed rises linearly in time
+ * LinearSpeed: speed rises by the same amount with every commutation step
+ */
+enum class Shape : uint8_t {
+	ConstantAcceleration,
+	LinearSpeed,
+};
+
+struct Parameters {
+	/* Duration of the ramp in us */
+	uint32_t length;
+	uint32_t finalRPM;
+	uint8_t motorPoles;
+	/* Upper limit for the commutation period in us */
+	uint32_t maxPeriod;
+	/* Duty cycle rises linearly in time from minPWM to finalPWM (promille) */
+	uint16_t minPWM;
+	uint16_t finalPWM;
+	Shape shape;
+};
+
+/* Commutation period in us at the final speed */
+constexpr uint32_t FinalPeriod(const Parameters &p) {
+	return 1000000UL / (p.finalRPM * 6 * p.motorPoles / 2 / 60);
+}
+
+constexpr uint32_t Limit(const Parameters &p, uint64_t period) {
+	return period < p.maxPeriod ? period : p.maxPeriod;
+}
+
+constexpr uint32_t LinearPeriod(const Parameters &p, uint16_t step,
+		uint16_t steps) {
+	return Limit(p, (uint64_t) FinalPeriod(p) * steps / (step + 1));
+}
+
+/* Number of steps of the LinearSpeed ramp to fill the requested length */
+constexpr uint16_t LinearSteps(const Parameters &p) {
+	uint16_t steps = 1;
+	while (true) {
+		uint32_t time = 0;
+		for (uint16_t i = 0; i < steps; i++) {
+			time += LinearPeriod(p, i, steps);
+		}
+		if (time >= p.length) {
+			return steps;
+		}
+		steps++;
+	}
+}
+
+constexpr uint32_t Period(const Parameters &p, uint16_t step, uint32_t time) {
+	if (p.shape == Shape::LinearSpeed) {
+		return LinearPeriod(p, step, LinearSteps(p));
+	}
+	if (time == 0) {
+		return p.maxPeriod;
+	}
+	return Limit(p, (uint64_t) FinalPeriod(p) * p.length / time);
+}
+
+constexpr uint16_t PWM(const Parameters &p, uint32_t time) {
+	return p.minPWM + (uint64_t) (p.finalPWM - p.minPWM) * time / p.length;
+}
+
+/* Number of commutation steps scheduled before the ramp ends */
+constexpr uint16_t Steps(const Parameters &p) {
+	uint16_t steps = 0;
+	uint32_t time = 0;
+	while (true) {
+		time += Period(p, steps, time);
+		if (time >= p.length) {
+			return steps;
+		}
+		steps++;
+	}
+}
+
+/* Upper limit for the number of steps of a ramp */
+static constexpr uint16_t MaxSteps = 128;
+
+/*
+ * Fills the commutation period in us and the duty cycle in promille of every
+ * step scheduled before the ramp ends. Returns the number of steps, 0 if the
+ * ramp needs more than maxSteps. period and pwm may be null to only count.
+ */
+inline uint16_t Generate(const Parameters &p, uint16_t *period, uint16_t *pwm,
+		uint16_t maxSteps = MaxSteps) {
+	if (p.finalRPM * p.motorPoles * 3 < 60 || !p.maxPeriod
+			|| p.maxPeriod > UINT16_MAX || p.length / p.maxPeriod > maxSteps
+			|| p.finalPWM < p.minPWM) {
+		return 0;
+	}
+	const uint16_t linear = p.shape == Shape::LinearSpeed ? LinearSteps(p) : 0;
+	uint32_t time = 0;
+	for (uint16_t i = 0; i < maxSteps; i++) {
+		const uint32_t length =
+				linear ? LinearPeriod(p, i, linear) : Period(p, i, time);
+		if (time + length >= p.length) {
+			return i;
+		}
+		if (period) {
+			period[i] = length;
+			pwm[i] = PWM(p, time);
+		}
+		time += length;
+	}
+	return 0;
+}
+
+}
+}
+}
@@ -7,24 +7,30 @@
 #include "task.h"
 #include "Detector.hpp"
 #include "PowerADC.hpp"
+#include "Config.hpp"
 
 #include "Tests.hpp"
 
 void Start() {
 	Log::Init(Log::Lvl::Crt);
 
+	const bool configured = HAL::BLDC::Config::Load();
 	HAL::BLDC::Detector::Init();
 	HAL::BLDC::PowerADC::Init();
 	HAL::BLDC::LowLevel::Init();
 
 	vTaskDelay(100);
-	Log::Uart(Log::Lvl::Inf, "Start");
+	LOG_UART(Log::Lvl::Inf, "Start (%s configuration)",
+			configured ? "stored" : "default");
 
 	vTaskDelay(2000);
 //	Test::ManualCommutation();
 //	Test::InductanceSense();
+//	Test::InductanceCalibration();
+//	Test::Identification();
 	Test::MotorStart();
 //	Test::MotorManualStart();
+//	Test::AdvanceCurve();
 //	Test::TimerTest();
 //	Test::SetMidPWM();
 //	HAL::BLDC::Detector::Enable(nullptr);
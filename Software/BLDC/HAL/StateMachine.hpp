@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+
+namespace HAL {
+namespace BLDC {
+
+struct StateStatistics {
+	uint32_t entries;
+	/* time spent in the state in us, completed stays only */
+	uint64_t time;
+	uint32_t longest;
+};
+
+/*
+ * Table driven state machine with run-to-completion semantics. Events may be
+ * posted from any context. They are queued and processed in order by the
+ * context that finds the machine idle, events posted meanwhile (e.g. from a
+ * preempting interrupt) wait until the running transition has completed.
+ * The first transition matching state, event and guard is taken, the state
+ * changes before its action runs. Events without a transition are dropped.
+ *
+ * No hardware dependencies: Lock is a scope guard excluding all posting
+ * contexts (CriticalSection on the target) and the clock is passed in, so
+ * machine and transition tables can be run on the host (see
+ * Tools/host/DriverTest.cpp).
+ */
+template<typename State, typename Event, uint8_t States, typename Lock,
+		uint8_t QueueLength = 8>
+class StateMachine {
+public:
+	struct Message {
+		Event event;
+		uint32_t arg0;
+		uint32_t arg1;
+	};
+	using Guard = bool(*)(const Message &m);
+	using Action = void(*)(const Message &m);
+	using Clock = uint32_t(*)(void);
+
+	struct Transition {
+		State from;
+		Event event;
+		/* transition only taken if the guard returns true, nullptr: always */
+		Guard guard;
+		State to;
+		/* nullptr: no action */
+		Action action;
+	};
+
+	StateMachine(const Transition *table, uint8_t transitions, State initial,
+			Clock clock) :
+			table(table), transitions(transitions), state(initial), clock(clock),
+			entered(0), head(0), count(0), busy(false), dropped(0), coverage(0),
+			stats { } {
+		stats[(uint8_t) initial].entries = 1;
+	}
+
+	/*
+	 * Queues the event and processes the queue unless a transition is already
+	 * running. Returns false if the queue was full.
+	 */
+	bool Post(Event e, uint32_t arg0 = 0, uint32_t arg1 = 0) {
+		{
+			Lock lock;
+			if (count >= QueueLength) {
+				dropped++;
+				return false;
+			}
+			Message &m = queue[(head + count) % QueueLength];
+			m.event = e;
+			m.arg0 = arg0;
+			m.arg1 = arg1;
+			count++;
+			if (busy) {
+				return true;
+			}
+			busy = true;
+		}
+		while (true) {
+			Message m;
+			{
+				Lock lock;
+				if (!count) {
+					busy = false;
+					return true;
+				}
+				m = queue[head];
+				head = (head + 1) % QueueLength;
+				count--;
+			}
+			Dispatch(m);
+		}
+	}
+
+	State Current() const {
+		return state;
+	}
+
+	StateStatistics GetStatistics(State s) const {
+		Lock lock;
+		return stats[(uint8_t) s];
+	}
+
+	void ResetStatistics() {
+		Lock lock;
+		for (uint8_t i = 0; i < States; i++) {
+			stats[i] = StateStatistics();
+		}
+		dropped = 0;
+		entered = clock();
+	}
+
+	/* Events lost to a full queue */
+	uint32_t Dropped() const {
+		return dropped;
+	}
+
+	/* Bit i is set once transition i has been taken (first 64 transitions) */
+	uint64_t Coverage() const {
+		return coverage;
+	}
+
+private:
+	void Dispatch(const Message &m) {
+		for (uint8_t i = 0; i < transitions; i++) {
+			const Transition &t = table[i];
+			if (t.from != state || t.event != m.event
+					|| (t.guard && !t.guard(m))) {
+				continue;
+			}
+			if (i < 64) {
+				coverage |= 1ULL << i;
+			}
+			if (t.to != state) {
+				Enter(t.to);
+			}
+			if (t.action) {
+				t.action(m);
+			}
+			return;
+		}
+	}
+
+	void Enter(State s) {
+		const uint32_t now = clock();
+		const uint32_t stay = now - entered;
+		Lock lock;
+		StateStatistics &left = stats[(uint8_t) state];
+		left.time += stay;
+		if (stay > left.longest) {
+			left.longest = stay;
+		}
+		stats[(uint8_t) s].entries++;
+		entered = now;
+		state = s;
+	}
+
+	const Transition *table;
+	const uint8_t transitions;
+	volatile State state;
+	const Clock clock;
+	uint32_t entered;
+	Message queue[QueueLength];
+	uint8_t head;
+	uint8_t count;
+	bool busy;
+	uint32_t dropped;
+	uint64_t coverage;
+	StateStatistics stats[States];
+};
+
+}
+}
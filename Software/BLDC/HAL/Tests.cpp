@@ -9,11 +9,15 @@
 #include "Driver.hpp"
 #include "Detector.hpp"
 #include "InductanceSensing.hpp"
+#include "Commutation.hpp"
+#include "SpeedControl.hpp"
+#include "Identification.hpp"
+#include "Config.hpp"
 
 using namespace HAL::BLDC;
 
 void Test::SetMidPWM(void) {
-	Log::Uart(Log::Lvl::Inf, "Test, setting mid PWM");
+	LOG_UART(Log::Lvl::Inf, "Test, setting mid PWM");
 	LowLevel::SetPWM(100);
 	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::High);
 	LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::High);
@@ -21,7 +25,7 @@ void Test::SetMidPWM(void) {
 }
 
 void Test::DifferentPWMs(void) {
-	Log::Uart(Log::Lvl::Inf, "Test, setting different PWMs");
+	LOG_UART(Log::Lvl::Inf, "Test, setting different PWMs");
 	LowLevel::SetPWM(100);
 	LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::High);
 	LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Low);
@@ -29,7 +33,7 @@ void Test::DifferentPWMs(void) {
 }
 
 void Test::MotorStart(void) {
-	Log::Uart(Log::Lvl::Inf, "Test, attempting to start motor");
+	LOG_UART(Log::Lvl::Inf, "Test, attempting to start motor");
 	Driver d;
 	while (1) {
 		d.InitiateStart();
@@ -43,16 +47,90 @@ void Test::MotorStart(void) {
 	}
 }
 
+void Test::SpeedControl(void) {
+	LOG_UART(Log::Lvl::Inf, "Test, closed loop speed control");
+	Driver d;
+	HAL::BLDC::SpeedControl control(d, Config::Active.start.motorPoles,
+			Config::Active.speed);
+	while (1) {
+		d.InitiateStart();
+		vTaskDelay(500);
+		if (d.GetState() != Driver::State::Running) {
+			vTaskDelay(2000);
+			continue;
+		}
+		control.SetRPM(1000);
+		control.Enable(100);
+		for (uint16_t rpm = 1000; rpm <= 3000; rpm += 500) {
+			control.SetRPM(rpm);
+			vTaskDelay(2000);
+			LOG_UART(Log::Lvl::Inf, "Setpoint %u RPM, measured %u RPM", rpm,
+					control.GetRPM());
+		}
+		control.Disable();
+		d.FreeRunning();
+		vTaskDelay(3000);
+	}
+}
+
+static void SumCurrent(void *ptr, uint32_t voltage, uint32_t current) {
+	UNUSED(voltage);
+	volatile uint32_t *sum = (volatile uint32_t*) ptr;
+	sum[0] += current;
+	sum[1]++;
+}
+
+void Test::AdvanceCurve(void) {
+	LOG_UART(Log::Lvl::Inf, "Test, commutation advance curves");
+	Driver d;
+	static constexpr Advance::Point None[] = { { 0, 0 } };
+	static constexpr Advance::Point Linear[] = { { 0, 0 }, { 40000, 20 } };
+	static constexpr Advance::Point Steep[] = { { 0, 5 }, { 10000, 15 },
+			{ 20000, 25 } };
+	static constexpr struct {
+		const Advance::Point *points;
+		uint8_t count;
+	} Curves[] = {
+		{ None, 1 },
+		{ Linear, 2 },
+		{ Steep, 3 },
+	};
+	static volatile uint32_t sum[2];
+	d.RegisterADCCallback(SumCurrent, (void*) sum);
+	while (1) {
+		for (uint8_t i = 0; i < sizeof(Curves) / sizeof(Curves[0]); i++) {
+			if (!d.SetAdvanceCurve(Curves[i].points, Curves[i].count)) {
+				continue;
+			}
+			d.InitiateStart();
+			vTaskDelay(500);
+			if (d.GetState() != Driver::State::Running) {
+				vTaskDelay(2000);
+				continue;
+			}
+			d.SetPWM(300);
+			vTaskDelay(2000);
+			sum[0] = sum[1] = 0;
+			vTaskDelay(1000);
+			const uint32_t period = d.GetCommutationPeriod();
+			LOG_UART(Log::Lvl::Inf, "Curve %d: %luus per step, %lumA", i,
+					period, sum[1] ? sum[0] / sum[1] : 0);
+			d.FreeRunning();
+			vTaskDelay(3000);
+		}
+	}
+}
+
 void Test::TimerTest(void) {
-	Log::Uart(Log::Lvl::Inf, "Test, registering callback in 1s (now: %lu)", HAL_GetTick());
+	LOG_UART(Log::Lvl::Inf, "Test, registering callback in 1s (now: %lu)", HAL_GetTick());
 	HAL_GPIO_WritePin(TRIGGER_GPIO_Port, TRIGGER_Pin, GPIO_PIN_SET);
 	Timer::Schedule(1000000, [](){
 		HAL_GPIO_WritePin(TRIGGER_GPIO_Port, TRIGGER_Pin, GPIO_PIN_RESET);
-		Log::Uart(Log::Lvl::Inf, "Callback executed at %lu", HAL_GetTick());
-		Log::Uart(Log::Lvl::Inf, "Test, registering callback in 20ms (now: %lu)", HAL_GetTick());
+		LOG_UART(Log::Lvl::Inf, "Callback executed at %lu", HAL_GetTick());
+		LOG_UART(Log::Lvl::Inf, "Test, registering callback in 20ms (now: %lu)", HAL_GetTick());
 		Timer::Schedule(20000, [](){
 			HAL_GPIO_WritePin(TRIGGER_GPIO_Port, TRIGGER_Pin, GPIO_PIN_SET);
-			Log::Uart(Log::Lvl::Inf, "Callback executed at %lu", HAL_GetTick());
+			LOG_UART(Log::Lvl::Inf, "Callback executed at %lu", HAL_GetTick());
 		});
 	});
 }
@@ -102,22 +180,81 @@ static void SetStep(uint8_t step) {
 
 void Test::InductanceSense() {
 	while (1) {
-		uint16_t pos = InductanceSensing::RotorPosition();
+		uint16_t pos = InductanceSensing::RotorPosition().sector;
 		pos = (8 - pos) % 6;
 		LowLevel::SetPWM(100);
 		SetStep(pos);
 		Detector::Enable(nullptr);
 		while(Detector::isEnabled());
 		Detector::PrintBuffer();
-//		Log::Uart(Log::Lvl::Inf, "Pos: %d", pos);
+//		LOG_UART(Log::Lvl::Inf, "Pos: %d", pos);
+		vTaskDelay(1000);
+	}
+}
+
+void Test::InductanceCalibration() {
+	// measure uncorrected angles
+	const int16_t none[InductanceSensing::CalibrationPoints] = { };
+	InductanceSensing::SetCalibration(none);
+	uint16_t measured[InductanceSensing::CalibrationPoints];
+	for (uint8_t i = 0; i < InductanceSensing::CalibrationPoints; i++) {
+		// the rotor aligns 90° ahead of the torque producing position
+		LowLevel::SetPWM(30);
+		Commutation::SetFineStep((12 - i) % 12);
 		vTaskDelay(1000);
+		LowLevel::SetPWM(0);
+		LowLevel::SetPhase(LowLevel::Phase::A, LowLevel::State::Idle);
+		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
+		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
+		vTaskDelay(100);
+
+		measured[i] = InductanceSensing::RotorPosition(16).angle;
+		LOG_UART(Log::Lvl::Inf, "Position: %d°, measured %lu°", i * 30,
+				measured[i] * 360UL / 65536);
+	}
+	InductanceSensing::Calibrate(measured);
+	int16_t table[InductanceSensing::CalibrationPoints];
+	InductanceSensing::GetCalibration(table);
+	for (uint8_t i = 0; i < InductanceSensing::CalibrationPoints; i++) {
+		LOG_UART(Log::Lvl::Inf, "Correction %d°: %d", i * 30, table[i]);
+	}
+	Config::Parameters p = Config::Active;
+	InductanceSensing::GetCalibration(p.calibration);
+	if (Config::Set(p) && Config::Save()) {
+		LOG_UART(Log::Lvl::Inf, "Calibration saved");
+	}
+}
+
+void Test::Identification() {
+	LOG_UART(Log::Lvl::Inf, "Test, motor identification");
+	Driver d;
+	Identification::Result r;
+	const bool success = Identification::Run(d, r);
+	LOG_UART(Log::Lvl::Inf, "Supply: %lumV, R: %lumOhm, L: %luuH", r.supply,
+			r.resistance, r.inductance);
+	LOG_UART(Log::Lvl::Inf, "Ke: %luuV/eRPM, J: %lu*1e-9kgm^2 (electrical)",
+			r.ke, r.inertia);
+	if (!success) {
+		return;
+	}
+	Config::Parameters p = Config::Active;
+	const Identification::Tuning t = Identification::Derive(r, p.start);
+	LOG_UART(Log::Lvl::Inf, "Blanking: %d, torque Kp: %ld, Ki: %ld",
+			t.blanking, t.torqueKp, t.torqueKi);
+	LOG_UART(Log::Lvl::Inf, "Start: %luus, PWM %d to %d", t.startLength,
+			t.startMinPWM, t.startFinalPWM);
+	LOG_UART(Log::Lvl::Inf, "Speed Kp: %ld, Ki: %ld, Kff: %ld", t.speed.Kp,
+			t.speed.Ki, t.speed.Kff);
+	Identification::Update(p, r, t);
+	if (Config::Set(p) && d.ApplyConfiguration() && Config::Save()) {
+		LOG_UART(Log::Lvl::Inf, "Configuration saved");
 	}
 }
 
 void Test::MotorManualStart(void) {
 	Driver d;
 	while (1) {
-		Log::Uart(Log::Lvl::Inf, "Waiting for external start");
+		LOG_UART(Log::Lvl::Inf, "Waiting for external start");
 		while(d.GetState() == Driver::State::Stopped) {
 			vTaskDelay(10);
 		}
@@ -182,7 +319,7 @@ void Test::ManualCommutation() {
 		LowLevel::SetPhase(LowLevel::Phase::B, LowLevel::State::Idle);
 		LowLevel::SetPhase(LowLevel::Phase::C, LowLevel::State::Idle);
 
-		uint8_t sector = InductanceSensing::RotorPosition();
-		Log::Uart(Log::Lvl::Inf, "Step: %d, Sector: %d", step, sector);
+		uint8_t sector = InductanceSensing::RotorPosition().sector;
+		LOG_UART(Log::Lvl::Inf, "Step: %d, Sector: %d", step, sector);
 	}
 }
@@ -6,8 +6,12 @@ void SetMidPWM(void);
 void DifferentPWMs(void);
 void MotorStart(void);
 void MotorManualStart(void);
+void SpeedControl(void);
+void AdvanceCurve(void);
 void TimerTest(void);
 void InductanceSense();
+void InductanceCalibration();
+void Identification();
 
 void ManualCommutation();
 
@@ -15,11 +15,11 @@ static void Init() {
 //    TIM7->CR1 = TIM_CR1_OPM;
     HAL_NVIC_SetPriority(TIM7_DAC2_IRQn, 6 ,0);
     HAL_NVIC_EnableIRQ(TIM7_DAC2_IRQn);
-	Log::Uart(Log::Lvl::Dbg, "Initialized one shot timer");
+	LOG_UART(Log::Lvl::Dbg, "Initialized one shot timer");
 }
 
 void HAL::BLDC::Timer::Schedule(uint32_t usTillExecution, Callback ptr) {
-	Log::Uart(Log::Lvl::Dbg, "Set cb for %luus (Tick: %lu, CB: %p)", usTillExecution, HAL_GetTick(), ptr);
+	LOG_DEFER(Log::Lvl::Dbg, "Set cb for %luus (Tick: %lu, CB: %p)", usTillExecution, HAL_GetTick(), ptr);
 
 	if(!initialized) {
 		Init();
@@ -60,6 +60,20 @@ void HAL::BLDC::Timer::Abort(void) {
 	cb = nullptr;
 }
 
+uint32_t HAL::BLDC::Timer::Micros(void) {
+	// TIM6 is the HAL time base, it counts microseconds and overflows every millisecond
+	uint32_t ms, us;
+	do {
+		ms = HAL_GetTick();
+		us = TIM6->CNT;
+	} while (ms != HAL_GetTick());
+	if ((TIM6->SR & TIM_SR_UIF) && us < 500) {
+		// counter overflowed but the tick interrupt could not run yet
+		ms++;
+	}
+	return ms * 1000 + us;
+}
+
 extern "C" {
 void TIM7_DAC2_IRQHandler(void) {
 	if (TIM7->SR & TIM_SR_UIF) {
@@ -67,11 +81,11 @@ void TIM7_DAC2_IRQHandler(void) {
 		TIM7->SR &= ~TIM_SR_UIF;
 		TIM7->CR1 &= ~TIM_CR1_CEN;
 		if (cb) {
-			Log::Uart(Log::Lvl::Dbg, "Exec cb (Tick: %lu CB: %p)", HAL_GetTick(), cb);
+			LOG_DEFER(Log::Lvl::Dbg, "Exec cb (Tick: %lu CB: %p)", HAL_GetTick(), cb);
 			auto buf = cb;
 			cb = nullptr;
 			buf();
-			Log::Uart(Log::Lvl::Dbg, "Exit cb");
+			LOG_DEFER(Log::Lvl::Dbg, "Exit cb");
 		}
 	}
 }
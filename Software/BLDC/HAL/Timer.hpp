@@ -11,6 +11,9 @@ using Callback = void(*)(void);
 void Schedule(uint32_t usTillExecution, Callback ptr);
 void Abort(void);
 
+/* Free running microsecond timestamp (wraps after ~71 minutes) */
+uint32_t Micros(void);
+
 }
 }
 }
@@ -7,6 +7,7 @@
 #pragma once
 #include <cstdint>
 #include <array>
+#include <atomic>
 
 #include "critical.hpp"
 
@@ -89,3 +90,189 @@ private:
 	volatile uint16_t level;
 	std::array<T, length> data;
 };
+
+/**
+ * \brief Lock-free single producer/single consumer FIFO
+ *
+ * Only the producer modifies head and only the consumer modifies tail, so no
+ * interrupts have to be masked as long as there is exactly one context on
+ * either end. Both indices run freely and are wrapped with a mask, hence the
+ * length must be a power of two.
+ */
+template<typename T, uint16_t length>
+class SPSCFifo {
+	static_assert(length > 0 && (length & (length - 1)) == 0,
+			"SPSCFifo length must be a power of two");
+	static_assert(length <= 32768, "SPSCFifo length exceeds index range");
+public:
+	constexpr SPSCFifo()
+	: head(0)
+	, tail(0)
+	, data()
+	{};
+
+	/**
+	 * \brief Adds an element to the FIFO (producer side)
+	 *
+	 * \param t the element to add
+	 * \return true on success, false on failure
+	 */
+	bool enqueue(T t) {
+		uint16_t h = head;
+		if((uint16_t) (h - tail) >= length) {
+			return false;
+		}
+		data[h & mask] = t;
+		std::atomic_signal_fence(std::memory_order_release);
+		head = h + 1;
+		return true;
+	}
+
+	/**
+	 * \brief Adds multiple elements to the FIFO (producer side)
+	 *
+	 * \param src elements to add
+	 * \param cnt number of elements in src
+	 * \return number of elements actually added (less than cnt if full)
+	 */
+	uint16_t enqueue(const T *src, uint16_t cnt) {
+		T *dst;
+		uint16_t done = 0;
+		// at most two contiguous regions before and after the wrap around
+		for(uint8_t i = 0; i < 2 && done < cnt; i++) {
+			uint16_t n = getWriteRegion(dst);
+			if(n > cnt - done) {
+				n = cnt - done;
+			}
+			for(uint16_t j = 0; j < n; j++) {
+				dst[j] = src[done + j];
+			}
+			commit(n);
+			done += n;
+		}
+		return done;
+	}
+
+	/**
+	 * \brief Reads an element from the FIFO (consumer side)
+	 *
+	 * \param t Will contain the element if one is available
+	 * \param justPeek If true the element will not be removed
+	 * \return true on success, false on failure
+	 */
+	bool dequeue(T &t, bool justPeek = false) {
+		uint16_t t_ = tail;
+		if(head == t_) {
+			return false;
+		}
+		std::atomic_signal_fence(std::memory_order_acquire);
+		t = data[t_ & mask];
+		if (!justPeek) {
+			std::atomic_signal_fence(std::memory_order_release);
+			tail = t_ + 1;
+		}
+		return true;
+	}
+
+	/**
+	 * \brief Reads multiple elements from the FIFO (consumer side)
+	 *
+	 * \param dst buffer for the elements
+	 * \param cnt maximum number of elements to read
+	 * \return number of elements actually read
+	 */
+	uint16_t dequeue(T *dst, uint16_t cnt) {
+		const T *src;
+		uint16_t done = 0;
+		for(uint8_t i = 0; i < 2 && done < cnt; i++) {
+			uint16_t n = getReadRegion(src);
+			if(n > cnt - done) {
+				n = cnt - done;
+			}
+			for(uint16_t j = 0; j < n; j++) {
+				dst[done + j] = src[j];
+			}
+			consume(n);
+			done += n;
+		}
+		return done;
+	}
+
+	/**
+	 * \brief Gets the largest contiguous block of free space (producer side)
+	 *
+	 * Data may be written directly (e.g. by DMA) and has to be made visible
+	 * to the consumer with commit() afterwards.
+	 * \param start Will point to the first free element
+	 * \return number of contiguous free elements
+	 */
+	uint16_t getWriteRegion(T *&start) {
+		uint16_t h = head;
+		uint16_t space = length - (uint16_t) (h - tail);
+		uint16_t toEnd = length - (h & mask);
+		start = &data[h & mask];
+		return space < toEnd ? space : toEnd;
+	}
+
+	/**
+	 * \brief Publishes elements written into the region from getWriteRegion()
+	 */
+	void commit(uint16_t cnt) {
+		std::atomic_signal_fence(std::memory_order_release);
+		head = head + cnt;
+	}
+
+	/**
+	 * \brief Gets the largest contiguous block of queued data (consumer side)
+	 *
+	 * Data may be read directly (e.g. by DMA) and has to be released with
+	 * consume() afterwards.
+	 * \param start Will point to the oldest element
+	 * \return number of contiguous elements available
+	 */
+	uint16_t getReadRegion(const T *&start) {
+		uint16_t t = tail;
+		uint16_t level = (uint16_t) (head - t);
+		uint16_t toEnd = length - (t & mask);
+		std::atomic_signal_fence(std::memory_order_acquire);
+		start = &data[t & mask];
+		return level < toEnd ? level : toEnd;
+	}
+
+	/**
+	 * \brief Releases elements read from the region from getReadRegion()
+	 */
+	void consume(uint16_t cnt) {
+		std::atomic_signal_fence(std::memory_order_release);
+		tail = tail + cnt;
+	}
+
+	/**
+	 * \brief Reads the amount of data in the FIFO
+	 */
+	uint16_t getLevel() {
+		return (uint16_t) (head - tail);
+	}
+
+	/**
+	 * \brief Gets the amount of free space in the FIFO
+	 */
+	uint16_t getSpace() {
+		return length - getLevel();
+	}
+
+	/**
+	 * \brief Removes all data from the FIFO without reading it
+	 *
+	 * Must not be called while either side is active
+	 */
+	void clear() {
+		head = 0;
+		tail = 0;
+	}
+private:
+	static constexpr uint16_t mask = length - 1;
+	volatile uint16_t head;
+	volatile uint16_t tail;
+	std::array<T, length> data;
+};
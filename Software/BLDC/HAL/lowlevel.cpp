@@ -2,6 +2,7 @@
 
 #include "stm32f3xx_hal.h"
 #include "stm32f303x8.h"
+#include "critical.hpp"
 
 static constexpr uint8_t PosFromMask(uint32_t mask) {
 	uint8_t pos = 0;
@@ -20,8 +21,30 @@ static constexpr GPIO_TypeDef *Ports[] = {PHASE_A_GPIO_Port, PHASE_B_GPIO_Port,
 extern TIM_HandleTypeDef htim1;
 extern TIM_HandleTypeDef htim2;
 
-constexpr uint16_t MaxPWM = 1600;
+static uint16_t period = HAL::BLDC::LowLevel::DefaultPeriod;
+static bool centered;
+// compare value of 100% duty cycle, half the period if center aligned
+static uint16_t top = HAL::BLDC::LowLevel::DefaultPeriod;
+// ceiling increase per RecoverPWM() call, ~8ms from zero to full duty
+constexpr uint8_t LimitRecoverySteps = 64;
 static uint16_t pwmVal;
+static volatile uint16_t pwmCeiling = HAL::BLDC::LowLevel::DefaultPeriod;
+// requested duty cycle, Q15
+static uint16_t duty;
+static bool dithering;
+// accumulated fraction of a timer count, Q15
+static uint16_t residue;
+
+static inline uint16_t Duty() {
+	return pwmVal < pwmCeiling ? pwmVal : pwmCeiling;
+}
+
+static inline void ApplyDuty() {
+	const uint16_t counts = Duty();
+	TIM1->CCR1 = counts;
+	TIM1->CCR2 = counts;
+	TIM1->CCR3 = counts;
+}
 
 void HAL::BLDC::LowLevel::Init() {
 	__HAL_DBGMCU_FREEZE_TIM2();
@@ -32,6 +55,8 @@ void HAL::BLDC::LowLevel::Init() {
 	SetPhase(Phase::B, State::Idle);
 	SetPhase(Phase::C, State::Idle);
 
+	// period changes take over at the update event like the compare values
+	TIM1->CR1 |= TIM_CR1_ARPE;
 	HAL_TIM_PWM_Start(&htim1, Channels[0]);
 	HAL_TIM_PWM_Start(&htim1, Channels[1]);
 	HAL_TIM_PWM_Start(&htim1, Channels[2]);
@@ -41,8 +66,116 @@ void HAL::BLDC::LowLevel::Init() {
 }
 
 void HAL::BLDC::LowLevel::SetPWM(int16_t promille) {
-	// directly modify PWM registers without HAL overhead
-	pwmVal = (int32_t) promille * MaxPWM / 1000;
+	SetDuty(promille > 0 ? ((int32_t) promille * DutyOne + 500) / 1000 : 0);
+}
+
+int16_t HAL::BLDC::LowLevel::GetPWM() {
+	return ((uint32_t) duty * 1000 + DutyOne / 2) / DutyOne;
+}
+
+void HAL::BLDC::LowLevel::SetDuty(uint16_t q15) {
+	duty = q15 < DutyOne ? q15 : DutyOne;
+	pwmVal = (uint32_t) duty * top / DutyOne;
+	// directly modify PWM registers without HAL overhead, the compare
+	// registers are preloaded and take over at the next period
+	ApplyDuty();
+}
+
+uint16_t HAL::BLDC::LowLevel::GetDuty() {
+	return duty;
+}
+
+void HAL::BLDC::LowLevel::EnableDithering(bool enable) {
+	residue = 0;
+	dithering = enable;
+}
+
+void HAL::BLDC::LowLevel::Dither() {
+	if (!dithering) {
+		return;
+	}
+	const uint32_t counts = (uint32_t) duty * top;
+	uint16_t val = counts / DutyOne;
+	residue += counts % DutyOne;
+	if (residue >= DutyOne) {
+		residue -= DutyOne;
+		val++;
+	}
+	pwmVal = val;
+	ApplyDuty();
+}
+
+void HAL::BLDC::LowLevel::LimitPWM() {
+	const uint16_t counts = Duty();
+	pwmCeiling = counts - counts / 4;
+	ApplyDuty();
+}
+
+void HAL::BLDC::LowLevel::RecoverPWM() {
+	// LimitPWM() is called from a higher priority interrupt
+	CriticalSection cs;
+	if (pwmCeiling >= top) {
+		return;
+	}
+	const uint16_t ceiling = pwmCeiling + top / LimitRecoverySteps;
+	pwmCeiling = ceiling < top ? ceiling : top;
+	ApplyDuty();
+}
+
+// rescales the duty cycle and the ceiling to a new compare range
+static void SetTop(uint16_t counts) {
+	pwmCeiling = (uint32_t) pwmCeiling * counts / top;
+	top = counts;
+	pwmVal = (uint32_t) duty * top / HAL::BLDC::LowLevel::DutyOne;
+	residue = 0;
+}
+
+void HAL::BLDC::LowLevel::SetPeriod(uint16_t counts) {
+	CriticalSection cs;
+	if (counts == period) {
+		return;
+	}
+	period = counts;
+	SetTop(centered ? counts / 2 : counts);
+	// counting up and down takes two counts per period count
+	TIM1->ARR = centered ? counts / 2 : counts - 1;
+	ApplyDuty();
+}
+
+uint16_t HAL::BLDC::LowLevel::GetPeriod() {
+	return period;
+}
+
+void HAL::BLDC::LowLevel::SetCenterAligned(bool enable) {
+	CriticalSection cs;
+	if (enable == centered) {
+		return;
+	}
+	centered = enable;
+	SetTop(enable ? period / 2 : period);
+	// the counting mode can only be changed with the counter disabled
+	TIM1->CR1 &= ~TIM_CR1_CEN;
+	TIM1->CR1 = (TIM1->CR1 & ~TIM_CR1_CMS) | (enable ? TIM_CR1_CMS_0 : 0);
+	TIM1->ARR = enable ? period / 2 : period - 1;
+	// with a repetition counter of 0 the update event marks both centers
+	TIM1->CR2 = (TIM1->CR2 & ~TIM_CR2_MMS2)
+			| (enable ? TIM_TRGO2_UPDATE : TIM_TRGO2_OC4REF_RISINGFALLING);
+	ApplyDuty();
+	TIM1->CNT = 0;
+	TIM1->EGR = TIM_EGR_UG;
+	TIM1->CR1 |= TIM_CR1_CEN;
+}
+
+bool HAL::BLDC::LowLevel::CenterAligned() {
+	return centered;
+}
+
+uint16_t HAL::BLDC::LowLevel::SampleInterval() {
+	return centered ? period / 2 : period;
+}
+
+bool HAL::BLDC::LowLevel::PWMLimited() {
+	return pwmCeiling < pwmVal;
 }
 
 void HAL::BLDC::LowLevel::SetPhase(Phase p, State s) {
@@ -55,9 +188,7 @@ void HAL::BLDC::LowLevel::SetPhase(Phase p, State s) {
 	switch (s) {
 	case State::High:
 		// Enable alternate function (PWM generation)
-		TIM1->CCR1 = pwmVal;
-		TIM1->CCR2 = pwmVal;
-		TIM1->CCR3 = pwmVal;
+		ApplyDuty();
 		gpio->MODER &= ~(0x01 << (pin * 2));
 		gpio->MODER |= (0x02 << (pin * 2));
 		break;
@@ -84,22 +215,35 @@ void HAL::BLDC::LowLevel::SetPhase(Phase p, State s) {
 
 #include "Detector.hpp"
 #include "PowerADC.hpp"
+#include "InductanceSensing.hpp"
 
 extern "C" {
 void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef* hadc) {
 	if(hadc->Instance == ADC1) {
+		HAL::BLDC::LowLevel::Dither();
 		HAL::BLDC::Detector::DMAComplete();
 	} else if(hadc->Instance == ADC2) {
-		HAL::BLDC::PowerADC::DMAComplete();
+		if (HAL::BLDC::InductanceSensing::Active()) {
+			HAL::BLDC::InductanceSensing::DMAComplete();
+		} else {
+			HAL::BLDC::PowerADC::DMAComplete();
+		}
 	}
 }
 
 void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef* hadc) {
 	if(hadc->Instance == ADC1) {
+		HAL::BLDC::LowLevel::Dither();
 		HAL::BLDC::Detector::DMAHalfComplete();
-	} else if(hadc->Instance == ADC2) {
+	} else if(hadc->Instance == ADC2 && !HAL::BLDC::InductanceSensing::Active()) {
 		HAL::BLDC::PowerADC::DMAHalfComplete();
 	}
 }
+
+void HAL_ADC_LevelOutOfWindowCallback(ADC_HandleTypeDef* hadc) {
+	if(hadc->Instance == ADC2) {
+		HAL::BLDC::PowerADC::WatchdogTripped();
+	}
+}
 }
 
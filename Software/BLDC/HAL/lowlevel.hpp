@@ -24,8 +24,55 @@ enum class State : uint8_t {
 
 void Init();
 void SetPWM(int16_t promille);
+int16_t GetPWM();
+/*
+ * Duty cycle in Q15, DutyOne = 100%. Finer than a timer count, the fraction
+ * is only applied with dithering enabled.
+ */
+static constexpr uint16_t DutyOne = 32768;
+void SetDuty(uint16_t q15);
+uint16_t GetDuty();
 void SetPhase(Phase p, State s);
 
+/*
+ * First order sigma-delta modulation of the duty cycle fraction below one
+ * timer count. Dither() applies the next duty cycle, it is called with every
+ * phase voltage sample (once per PWM period).
+ */
+void EnableDithering(bool enable);
+void Dither();
+
+/*
+ * PWM period in timer counts (32MHz), a multiple of CountsPerUs. Takes over
+ * at the next update event together with the rescaled duty cycle. The phase
+ * voltages are sampled once per period at the same offset (TIM1 CCR4).
+ */
+static constexpr uint8_t CountsPerUs = 32;
+static constexpr uint16_t DefaultPeriod = 1600;
+void SetPeriod(uint16_t counts);
+uint16_t GetPeriod();
+
+/*
+ * Center aligned PWM: the on time is centered on the counter underflow. The
+ * phase voltages are sampled in the middle of both the on and the off time
+ * instead of at the sampling offset, with synchronous sampling the bus current
+ * as well (see PowerADC::GetCenterCurrent()). Restarts the counter, only
+ * while the phases are idle.
+ */
+void SetCenterAligned(bool enable);
+bool CenterAligned();
+/* Timer counts between two phase voltage samples */
+uint16_t SampleInterval();
+
+/*
+ * Cycle-by-cycle current limit. LimitPWM() lowers the duty ceiling to three
+ * quarters of the applied duty, effective with the next PWM period.
+ * RecoverPWM() raises the ceiling again in small steps.
+ */
+void LimitPWM();
+void RecoverPWM();
+bool PWMLimited();
+
 }
 
 }
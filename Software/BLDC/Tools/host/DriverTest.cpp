@@ -0,0 +1,107 @@
+/*
+ * Host test of the driver state machine: takes every row of the transition
+ * table in Driver.cpp and checks the coverage reported by the machine.
+ *
+ * Each row is reached from Stopped by a short event sequence, then the guard
+ * inputs are enumerated until the row's event takes it. The hardware modules
+ * are replaced by Stubs.cpp, the actions run unchanged.
+ */
+
+#include "Driver.cpp"
+
+#include "Stubs.hpp"
+
+#include <cstdio>
+
+static constexpr uint8_t Rows = sizeof(Transitions) / sizeof(Transitions[0]);
+static_assert(Rows <= 64, "Coverage() reports the first 64 transitions");
+
+static Driver::Direction Other(Driver::Direction d) {
+	return d == Driver::Direction::Forward ?
+			Driver::Direction::Reverse : Driver::Direction::Forward;
+}
+
+/* One bit per guard input, see SetWorld() */
+static constexpr uint16_t Worlds = 1 << 10;
+
+static void SetWorld(uint16_t w) {
+	recovering = w & 0x001;
+	idleValid = w & 0x002;
+	idleDirectionKnown = w & 0x004;
+	idleDirection = (w & 0x008) ? Other(direction) : direction;
+	idlePeriod = (w & 0x010) ? 1000000 : 0;
+	brakeCurrent = (w & 0x020) ? 1000 : 0;
+	timeBetweenCommutations = (w & 0x040) ? 1000000 : 100;
+	StartSteps = (w & 0x080) ? startLength : 0;
+	anomalies = (w & 0x100) ? MaxAnomalies : 0;
+	sensedStartTime = Stubs::now - ((w & 0x200) ? SensedTimeout + 1 : 0);
+}
+
+static bool Reach(Driver::State s) {
+	SetWorld(0);
+	Post(Event::Reset);
+	switch (s) {
+	case Driver::State::Stopped:
+		break;
+	case Driver::State::Starting:
+		Post(Event::Start);
+		break;
+	case Driver::State::Running:
+		Post(Event::Start);
+		Post(Event::Crossing);
+		break;
+	case Driver::State::Stopping:
+		Post(Event::Turning);
+		break;
+	case Driver::State::Reversing:
+		Post(Event::Turning);
+		Post(Event::Reverse, (uint32_t) Other(direction));
+		break;
+	case Driver::State::Braking:
+		Post(Event::Start);
+		Post(Event::Crossing);
+		brakeCurrent = 1000;
+		Post(Event::Brake);
+		break;
+	}
+	return machine.Current() == s;
+}
+
+int main() {
+	Stubs::config.start = { 140000, 800, 12, 10000, 100, 101,
+			StartRamp::Shape::ConstantAcceleration };
+	Stubs::config.currentLimit = 15000;
+	Stubs::config.advance[0] = Advance::DefaultCurve[0];
+	Stubs::config.advancePoints = 1;
+	Stubs::now = 100000000;
+	// generates the start ramp
+	Driver driver;
+
+	int failed = 0;
+	for (uint8_t i = 0; i < Rows; i++) {
+		const Machine::Transition &t = Transitions[i];
+		for (uint16_t w = 0; w < Worlds && !(machine.Coverage() >> i & 1); w++) {
+			if (!Reach(t.from)) {
+				printf("row %u: state %u not reached\n", i, (unsigned) t.from);
+				return 1;
+			}
+			SetWorld(w);
+			Post(t.event, (uint32_t) Other(direction));
+		}
+		if (!(machine.Coverage() >> i & 1)) {
+			printf("row %u (state %u, event %u) never taken\n", i,
+					(unsigned) t.from, (unsigned) t.event);
+			failed++;
+		}
+	}
+
+	const uint64_t all = Rows == 64 ? ~0ULL : (1ULL << Rows) - 1;
+	if (failed || machine.Coverage() != all) {
+		printf("FAIL: coverage %016llx, expected %016llx\n",
+				(unsigned long long) machine.Coverage(),
+				(unsigned long long) all);
+		return 1;
+	}
+	printf("PASS: all %u transitions taken\n", Rows);
+	return 0;
+}
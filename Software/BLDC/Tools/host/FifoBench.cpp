@@ -0,0 +1,97 @@
+/*
+ * Host micro benchmark of the FIFOs in fifo.hpp: the interrupt masking Fifo
+ * against the lock-free SPSCFifo, single element and bulk, in the pattern of
+ * the log buffer (lines of 40 bytes written and drained in turns).
+ *
+ * On the host CriticalSection is free (see stubs/stm32f3xx_hal.h), the
+ * numbers compare the index handling only. On the target every Fifo element
+ * additionally costs a PRIMASK read, cpsid and cpsie.
+ */
+
+#include "fifo.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+static constexpr uint16_t Length = 1024;
+static constexpr uint16_t Line = 40;
+static constexpr uint32_t Lines = 2000000;
+
+static uint8_t line[Line];
+static uint8_t out[Length];
+
+template<typename F>
+static double Run(const char *name, F f) {
+	uint32_t check = 0;
+	const auto start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < Lines; i++) {
+		check += f();
+	}
+	const auto end = std::chrono::steady_clock::now();
+	const double ns = std::chrono::duration<double, std::nano>(end - start).count()
+			/ ((double) Lines * Line);
+	if (check != Lines * Line) {
+		printf("%-36s FAILED, %u of %u bytes\n", name, check, Lines * Line);
+		return 0;
+	}
+	printf("%-36s %6.2f ns/byte\n", name, ns);
+	return ns;
+}
+
+int main() {
+	for (uint16_t i = 0; i < Line; i++) {
+		line[i] = 'a' + i % 26;
+	}
+
+	static Fifo<uint8_t, Length> fifo;
+	static SPSCFifo<uint8_t, Length> spsc;
+
+	const double base = Run("Fifo, per byte", [] {
+		uint16_t n = 0;
+		for (uint16_t i = 0; i < Line; i++) {
+			fifo.enqueue(line[i]);
+		}
+		uint8_t c;
+		while (fifo.dequeue(c)) {
+			out[n++] = c;
+		}
+		return memcmp(out, line, Line) ? 0 : n;
+	});
+	const double single = Run("SPSCFifo, per byte", [] {
+		uint16_t n = 0;
+		for (uint16_t i = 0; i < Line; i++) {
+			spsc.enqueue(line[i]);
+		}
+		uint8_t c;
+		while (spsc.dequeue(c)) {
+			out[n++] = c;
+		}
+		return memcmp(out, line, Line) ? 0 : n;
+	});
+	const double bulk = Run("SPSCFifo, bulk", [] {
+		spsc.enqueue(line, Line);
+		const uint16_t n = spsc.dequeue(out, Length);
+		return memcmp(out, line, Line) ? 0 : n;
+	});
+	const double region = Run("SPSCFifo, bulk in, read regions", [] {
+		spsc.enqueue(line, Line);
+		// as the UART DMA drains it: contiguous blocks, up to two per line
+		uint16_t n = 0;
+		const uint8_t *src;
+		uint16_t cnt;
+		while ((cnt = spsc.getReadRegion(src))) {
+			memcpy(&out[n], src, cnt);
+			spsc.consume(cnt);
+			n += cnt;
+		}
+		return memcmp(out, line, Line) ? 0 : n;
+	});
+
+	if (!base || !single || !bulk || !region) {
+		return 1;
+	}
+	printf("speedup against Fifo: %.1fx per byte, %.1fx bulk, %.1fx regions\n",
+			base / single, base / bulk, base / region);
+	return 0;
+}
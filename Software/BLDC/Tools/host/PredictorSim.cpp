@@ -0,0 +1,142 @@
+/*
+ * Host simulation of the crossing predictor (Predictor.cpp) against the raw
+ * crossing intervals it replaced, with injected noise crossings.
+ *
+ * The motor runs at about 1ms per commutation step with a slow +-5% speed
+ * variation. The detector is enabled three samples after each commutation and
+ * sees the true crossing on the next 50us sample with 10us of jitter. With
+ * probability p a noise crossing is seen first, at a random time between
+ * enabling and the true crossing. A detector enabled after the true crossing
+ * misses it: the motor is desynchronized, as well as after MaxAnomalies steps
+ * without an accepted crossing. The driver recovers by re-catching the
+ * coasting motor, here both schemes restart from the true crossing.
+ *
+ * raw:       the first crossing seen is trusted, the commutation follows half
+ *            of the raw interval later (the driver before the predictor)
+ * predictor: the crossing updates the tracker, a rejected one re-enables the
+ *            detector for the true crossing, a rejected true crossing coasts.
+ *            The commutation follows half of the filtered period after the
+ *            filtered crossing.
+ *
+ * A commutation more than a quarter period away from the true one is counted
+ * as bad. Exits with 1 unless the predictor desynchronizes less often than the
+ * raw intervals at every noise level.
+ */
+
+#include "Predictor.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+using namespace HAL::BLDC;
+
+static constexpr uint32_t Steps = 200000;
+static constexpr double SampleUs = 50;
+static constexpr double BlankingUs = 3 * SampleUs;
+static constexpr double BasePeriod = 1000;
+static constexpr double JitterUs = 10;
+// as in Driver.cpp
+static constexpr uint8_t MaxAnomalies = 6;
+
+struct Result {
+	uint32_t bad;
+	uint32_t desyncs;
+	uint32_t rejected;
+};
+
+static double TruePeriod(uint32_t step) {
+	return BasePeriod * (1 + 0.05 * sin(2 * M_PI * step / 600));
+}
+
+static Result Simulate(double p, bool predictor, uint32_t seed) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	std::normal_distribution<double> jitter(0, JitterUs);
+
+	Result r = { };
+	double crossing = 10000;
+	double commutation = crossing + BasePeriod / 2;
+	double lastSeen = crossing;
+	uint8_t anomalies = 0;
+	Predictor::Reset((uint32_t) BasePeriod);
+	const uint32_t rejectedBefore = Predictor::GetRejected();
+
+	for (uint32_t k = 0; k < Steps; k++) {
+		const double period = TruePeriod(k);
+		crossing += period;
+		const double enable = commutation + BlankingUs;
+		bool desync = enable >= crossing;
+		double next = 0;
+		if (!desync) {
+			// first detector sample after the true crossing
+			const double detected = ceil(crossing / SampleUs) * SampleUs
+					+ jitter(rng);
+			double seen = detected;
+			const bool noise = uniform(rng) < p;
+			if (noise) {
+				seen = enable + uniform(rng) * (crossing - enable);
+			}
+
+			if (!predictor) {
+				next = seen + (seen - lastSeen) / 2;
+			} else {
+				bool accepted = Predictor::Update((uint32_t) seen,
+						(uint32_t) (seen - lastSeen));
+				if (!accepted && noise) {
+					// still listening, the true crossing follows
+					lastSeen = seen;
+					seen = detected;
+					accepted = Predictor::Update((uint32_t) seen,
+							(uint32_t) (seen - lastSeen));
+				}
+				if (accepted) {
+					anomalies = 0;
+				} else {
+					Predictor::Coast();
+					// the driver gives up after MaxAnomalies flywheel steps
+					desync = ++anomalies >= MaxAnomalies;
+				}
+				const double filtered = seen
+						- Predictor::SinceCrossing((uint32_t) seen);
+				next = filtered + Predictor::Period() / 2.0;
+			}
+			lastSeen = seen;
+		}
+		if (desync) {
+			r.desyncs++;
+			commutation = crossing + TruePeriod(k + 1) / 2;
+			lastSeen = crossing;
+			anomalies = 0;
+			Predictor::Reset(0);
+			continue;
+		}
+
+		const double error = fabs(next - (crossing + TruePeriod(k + 1) / 2));
+		if (error > period / 4) {
+			r.bad++;
+		}
+		commutation = next;
+	}
+	r.rejected = Predictor::GetRejected() - rejectedBefore;
+	return r;
+}
+
+int main() {
+	static const double Noise[] = { 0, 0.01, 0.02, 0.05, 0.1, 0.2 };
+	printf("%u steps per run, bad: commutation >1/4 period off, desync: "
+			"motor lost and re-caught\n\n", Steps);
+	printf("noise   raw bad  raw desync   pred bad  pred desync  rejected\n");
+	bool improved = true;
+	for (double p : Noise) {
+		const Result raw = Simulate(p, false, 1);
+		const Result pred = Simulate(p, true, 1);
+		printf("%4.0f%% %9u %11u %10u %12u %9u\n", p * 100, raw.bad,
+				raw.desyncs, pred.bad, pred.desyncs, pred.rejected);
+		if (pred.desyncs > raw.desyncs
+				|| (raw.desyncs && pred.desyncs == raw.desyncs)) {
+			improved = false;
+		}
+	}
+	return improved ? 0 : 1;
+}
@@ -0,0 +1,132 @@
+#include "Stubs.hpp"
+
+#include "lowlevel.hpp"
+#include "Detector.hpp"
+#include "InductanceSensing.hpp"
+#include "PowerADC.hpp"
+#include "Logging.hpp"
+
+using namespace HAL::BLDC;
+
+uint32_t Stubs::now;
+Timer::Callback Stubs::scheduled;
+Config::Parameters Stubs::config;
+
+const Config::Parameters &Config::Active = Stubs::config;
+
+void Timer::Schedule(uint32_t, Callback ptr) {
+	Stubs::scheduled = ptr;
+}
+
+void Timer::Abort() {
+	Stubs::scheduled = nullptr;
+}
+
+uint32_t Timer::Micros() {
+	return Stubs::now;
+}
+
+static uint16_t duty;
+static uint16_t period = LowLevel::DefaultPeriod;
+static bool centered;
+
+void LowLevel::SetPWM(int16_t promille) {
+	duty = (int32_t) promille * DutyOne / 1000;
+}
+
+void LowLevel::SetDuty(uint16_t q15) {
+	duty = q15;
+}
+
+uint16_t LowLevel::GetDuty() {
+	return duty;
+}
+
+void LowLevel::SetPhase(Phase, State) {
+}
+
+void LowLevel::EnableDithering(bool) {
+}
+
+void LowLevel::SetPeriod(uint16_t counts) {
+	period = counts;
+}
+
+uint16_t LowLevel::GetPeriod() {
+	return period;
+}
+
+void LowLevel::SetCenterAligned(bool enable) {
+	centered = enable;
+}
+
+bool LowLevel::CenterAligned() {
+	return centered;
+}
+
+void LowLevel::LimitPWM() {
+}
+
+void LowLevel::RecoverPWM() {
+}
+
+bool LowLevel::PWMLimited() {
+	return false;
+}
+
+void Detector::SetPhase(Phase, bool) {
+}
+
+void Detector::Enable(Callback, uint16_t) {
+}
+
+void Detector::Disable() {
+}
+
+void Detector::SetBlanking(uint8_t) {
+}
+
+void Detector::SetSamplingOffset(uint16_t) {
+}
+
+void Detector::EnableIdleTracking(IdleCallback) {
+}
+
+void Detector::DisableIdleTracking() {
+}
+
+uint16_t Detector::GetLastSample(Phase) {
+	return 0;
+}
+
+uint32_t Detector::SampleTomV(uint16_t sample) {
+	return sample;
+}
+
+bool InductanceSensing::Start(Callback, uint8_t, uint8_t, bool) {
+	return true;
+}
+
+void InductanceSensing::Abort() {
+}
+
+void InductanceSensing::SetCalibration(const int16_t*) {
+}
+
+void PowerADC::SetCallback(Callback, void*, uint16_t) {
+}
+
+void PowerADC::SetCurrentLimit(uint32_t, LimitCallback) {
+}
+
+void PowerADC::EnableSynchronousSampling(bool) {
+}
+
+void Log::Uart(enum Lvl, const char*, ...) {
+}
+
+void Log::Trace(char) {
+}
+
+void Log::Deferred(enum Lvl, const char*, const uint32_t*, uint8_t) {
+}
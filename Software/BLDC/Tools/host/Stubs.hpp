@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+ * Host replacements for the hardware modules used by Driver.cpp. Outputs are
+ * dropped, the clock and the configuration are set by the test.
+ */
+
+#include "Config.hpp"
+#include "Timer.hpp"
+
+namespace Stubs {
+
+/* Returned by Timer::Micros() */
+extern uint32_t now;
+/* Last Timer::Schedule() callback, nullptr after Timer::Abort() */
+extern HAL::BLDC::Timer::Callback scheduled;
+/* Referenced by Config::Active */
+extern HAL::BLDC::Config::Parameters config;
+
+}
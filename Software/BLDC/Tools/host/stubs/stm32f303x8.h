@@ -0,0 +1,3 @@
+#pragma once
+
+/* Host builds: no peripheral registers */
@@ -0,0 +1,15 @@
+#pragma once
+
+/* Host builds: the interrupt mask used by CriticalSection, nothing else */
+
+#include <cstdint>
+
+#define UNUSED(x) ((void)(x))
+
+inline uint32_t __get_PRIMASK(void) {
+	return 0;
+}
+inline void __disable_irq(void) {
+}
+inline void __enable_irq(void) {
+}
@@ -0,0 +1,281 @@
+#!/usr/bin/env python3
+"""
+Decodes the single character commutation trace of the BLDC firmware.
+
+The firmware emits the following markers (Log::WriteChar / Log::Trace):
+  N  next open loop start step          B  crossing callback (Driver)
+  M  commutation                        A  detector analyzed a sample
+  S  sample skipped (blanking)          H  hysteresis valid
+  C  zero crossing                      D  crossing detected (hysteresis passed)
+  T  no crossing in time, motor stalled  R  crossing rejected by the predictor
+Log lines ("[INF|<us>]:message") may be interleaved with the markers. Their
+capture time is used with marker timestamps only, deferred records are printed
+later than the markers around them.
+
+When built with TRACE_TIMESTAMPS=1 every marker except 'A' and 'S' is followed
+by four base 32 digits holding the lower 20 bits of the microsecond timestamp.
+Without timestamps the time base is reconstructed from the 'A' markers which
+are emitted once per ADC sample (--sample-us, 50us by default). Time spent with
+the detector disabled is invisible in that case, the timestamped trace should
+be used for accurate delays.
+
+Usage:
+  trace_timeline.py capture.bin [-o trace.json] [--cycles]
+
+The JSON output can be opened in chrome://tracing or https://ui.perfetto.dev
+"""
+
+import argparse
+import json
+import re
+import statistics
+import sys
+
+MARKERS = set('NBMASHCDTR')
+TIMESTAMPED = set('NBMHCDTR')
+BASE32 = '0123456789abcdefghijklmnopqrstuv'
+STAMP_BITS = 20
+STAMP_MASK = (1 << STAMP_BITS) - 1
+LOG_LINE = re.compile(r'\[(\w{3})(?:\|(\d+))?\]:(.*)')
+
+
+def unwrap(value, now):
+    """Places a 20 bit timestamp within half its range around now"""
+    delta = (value - now) & STAMP_MASK
+    if delta > STAMP_MASK // 2:
+        delta -= STAMP_MASK + 1
+    return now + delta
+
+
+def parse(data, timestamped, sample_us):
+    """Returns a list of (time_us, kind, payload) tuples"""
+    text = data.decode('ascii', errors='replace')
+    events = []
+    now = 0
+    i = 0
+    n = len(text)
+    while i < n:
+        c = text[i]
+        if c == '[':
+            end = text.find('\n', i)
+            if end < 0:
+                end = n
+            m = LOG_LINE.match(text[i:end])
+            if m:
+                lvl, stamp, msg = m.groups()
+                # Deferred records are printed milliseconds after their capture
+                # time, the stamp never moves the time base. It shares the clock
+                # of the marker timestamps, without them the record stays at its
+                # position in the stream.
+                if stamp is not None and timestamped:
+                    at = unwrap(int(stamp) & STAMP_MASK, now)
+                    payload = '[%s] %s' % (lvl, msg.strip())
+                else:
+                    at = now
+                    payload = '[%s|%s] %s' % (lvl, stamp, msg.strip()) \
+                        if stamp is not None else '[%s] %s' % (lvl, msg.strip())
+                events.append((at, 'log', payload))
+            i = end + 1
+            continue
+        i += 1
+        if c not in MARKERS:
+            continue
+        if c == 'A':
+            now += sample_us
+        elif timestamped and c in TIMESTAMPED:
+            digits = text[i:i + 4]
+            if len(digits) == 4 and all(d in BASE32 for d in digits):
+                value = 0
+                for d in digits:
+                    value = value * 32 + BASE32.index(d)
+                i += 4
+                # relative to the current time, the time reconstructed from 'A'
+                # markers may be slightly ahead
+                now = unwrap(value, now)
+        events.append((now, c, None))
+    return events
+
+
+def detect_timestamps(data):
+    """True if the markers in the capture are followed by base 32 digits"""
+    text = data.decode('ascii', errors='replace')
+    hits = re.findall(r'[NBMHCD][0-9a-v]{4}', text)
+    bare = re.findall(r'[NBMHCD](?![0-9a-v]{4})', text)
+    return len(hits) > len(bare)
+
+
+class Step:
+    """One commutation step, from an 'M' (or 'N') marker to the next one"""
+
+    def __init__(self, start, kind):
+        self.start = start
+        self.kind = kind
+        self.end = None
+        self.first_sample = None
+        self.skipped = 0
+        self.hysteresis = None
+        self.crossing = None
+        self.detected = None
+        self.callback = None
+
+    @property
+    def blanking(self):
+        if self.first_sample is None:
+            return None
+        return self.first_sample - self.start
+
+    @property
+    def delay(self):
+        """Crossing to next commutation"""
+        if self.crossing is None or self.end is None:
+            return None
+        return self.end - self.crossing
+
+
+def build_steps(events):
+    markers = [e for e in events if e[1] != 'log']
+    steps = []
+    current = None
+    for idx, (t, kind, _) in enumerate(markers):
+        if kind in ('M', 'N'):
+            if current:
+                current.end = t
+            current = Step(t, kind)
+            steps.append(current)
+        elif current is None:
+            continue
+        elif kind == 'A':
+            # the detector emits 'S' right after 'A' for a skipped sample
+            skipped = idx + 1 < len(markers) and markers[idx + 1][1] == 'S'
+            if not skipped and current.first_sample is None:
+                current.first_sample = t
+        elif kind == 'S':
+            current.skipped += 1
+        elif kind == 'H' and current.hysteresis is None:
+            current.hysteresis = t
+        elif kind == 'C' and current.crossing is None:
+            current.crossing = t
+        elif kind == 'D' and current.detected is None:
+            current.detected = t
+        elif kind == 'B' and current.callback is None:
+            current.callback = t
+    return steps
+
+
+def summary(name, values, unit='us'):
+    values = [v for v in values if v is not None]
+    if not values:
+        return '%-28s n=0' % name
+    values.sort()
+    p95 = values[min(len(values) - 1, int(len(values) * 0.95))]
+    return '%-28s n=%-6d mean=%8.1f%s min=%6d max=%6d p95=%6d' % (
+        name, len(values), statistics.mean(values), unit, values[0], values[-1], p95)
+
+
+def analyze(steps, cycles, stalls=0, rejected=0):
+    closed = [s for s in steps if s.kind == 'M' and s.end is not None]
+    start = [s for s in steps if s.kind == 'N']
+    missed = [s for s in closed if s.crossing is None]
+    lines = []
+    lines.append('open loop start steps       %d' % len(start))
+    lines.append('commutations                %d' % len(closed))
+    lines.append(summary('commutation interval', [s.end - s.start for s in closed]))
+    lines.append(summary('blanking', [s.blanking for s in closed]))
+    lines.append(summary('skipped samples', [s.skipped for s in closed], unit=''))
+    lines.append(summary('commutation to crossing',
+                         [s.crossing - s.start for s in closed if s.crossing is not None]))
+    lines.append(summary('crossing to detection',
+                         [s.detected - s.crossing for s in closed
+                          if s.crossing is not None and s.detected is not None]))
+    lines.append(summary('crossing to commutation', [s.delay for s in closed]))
+    rate = 100.0 * len(missed) / len(closed) if closed else 0.0
+    lines.append('missed crossings            %d (%.2f%%)' % (len(missed), rate))
+    lines.append('rejected crossings          %d' % rejected)
+    lines.append('stalls                      %d' % stalls)
+    if cycles:
+        lines.append('')
+        lines.append('cycle     start_us  period_us      eRPM  missed')
+        for c in range(len(closed) // 6):
+            group = closed[c * 6:(c + 1) * 6]
+            period = group[-1].end - group[0].start
+            erpm = 60e6 / period if period > 0 else 0
+            lost = sum(1 for s in group if s.crossing is None)
+            lines.append('%5d %12d %10d %9.0f %7d' % (c, group[0].start, period, erpm, lost))
+    return '\n'.join(lines)
+
+
+def chrome_trace(events, steps):
+    trace = []
+    pid = 1
+    for idx, s in enumerate(steps):
+        if s.end is None:
+            continue
+        name = 'start step' if s.kind == 'N' else 'step %d' % (idx % 6)
+        args = {'skipped': s.skipped}
+        if s.delay is not None:
+            args['crossing_to_commutation_us'] = s.delay
+        if s.crossing is None and s.kind == 'M':
+            args['missed_crossing'] = True
+        trace.append({'name': name, 'ph': 'X', 'ts': s.start, 'dur': s.end - s.start,
+                      'pid': pid, 'tid': 1, 'args': args})
+        if s.blanking:
+            trace.append({'name': 'blanking', 'ph': 'X', 'ts': s.start, 'dur': s.blanking,
+                          'pid': pid, 'tid': 2})
+        if s.kind == 'M':
+            period = s.end - s.start
+            if period > 0:
+                trace.append({'name': 'eRPM', 'ph': 'C', 'ts': s.start, 'pid': pid,
+                              'args': {'eRPM': round(10e6 / period)}})
+    names = {'H': 'hysteresis valid', 'C': 'crossing', 'D': 'detected', 'B': 'crossing callback',
+             'T': 'stall', 'R': 'rejected'}
+    for t, kind, payload in events:
+        if kind in names:
+            trace.append({'name': names[kind], 'ph': 'i', 's': 't', 'ts': t,
+                          'pid': pid, 'tid': 3})
+        elif kind == 'log':
+            trace.append({'name': payload, 'ph': 'i', 's': 'g', 'ts': t, 'pid': pid, 'tid': 4})
+    meta = [('commutation', 1), ('blanking', 2), ('detector', 3), ('log', 4)]
+    for name, tid in meta:
+        trace.append({'name': 'thread_name', 'ph': 'M', 'pid': pid, 'tid': tid,
+                      'args': {'name': name}})
+    return {'traceEvents': trace, 'displayTimeUnit': 'ms'}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode the BLDC commutation trace')
+    parser.add_argument('capture', help='raw UART capture ("-" for stdin)')
+    parser.add_argument('-o', '--output', help='write Chrome/Perfetto trace JSON')
+    parser.add_argument('--sample-us', type=int, default=50,
+                        help='time between two \'A\' markers (default 50)')
+    parser.add_argument('--timestamps', choices=('auto', 'yes', 'no'), default='auto',
+                        help='markers carry timestamps (TRACE_TIMESTAMPS=1 build)')
+    parser.add_argument('--cycles', action='store_true',
+                        help='print a per electrical cycle timeline')
+    args = parser.parse_args()
+
+    if args.capture == '-':
+        data = sys.stdin.buffer.read()
+    else:
+        with open(args.capture, 'rb') as f:
+            data = f.read()
+
+    if args.timestamps == 'auto':
+        timestamped = detect_timestamps(data)
+    else:
+        timestamped = args.timestamps == 'yes'
+
+    events = parse(data, timestamped, args.sample_us)
+    steps = build_steps(events)
+    print('time base: %s' % ('marker timestamps' if timestamped
+                             else '%dus per sample marker' % args.sample_us))
+    stalls = sum(1 for _, kind, _ in events if kind == 'T')
+    rejected = sum(1 for _, kind, _ in events if kind == 'R')
+    print(analyze(steps, args.cycles, stalls, rejected))
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(chrome_trace(events, steps), f)
+
+
+if __name__ == '__main__':
+    main()